@@ -0,0 +1,158 @@
+'use strict';
+/*global WebAssembly*/
+
+// Runs the same workloads against every wasm build and prints the timings:
+//
+//   npm run bench [-- image]
+//
+// Each build runs in its own process, EXT2FS_BUILD selects it, see
+// lib/instance.js.
+
+const { spawnSync } = require('child_process');
+const { existsSync, readFileSync, statSync } = require('fs');
+const { join } = require('path');
+
+// JSPI is still behind a flag in some node versions.
+const JSPI_FLAGS = typeof WebAssembly.Suspending === 'function' ? [] : ['--experimental-wasm-jspi'];
+
+const BUILDS = {
+	asyncify: { wasm: 'libext2fs.wasm', flags: [] },
+	jspi: { wasm: 'libext2fs-jspi.wasm', flags: JSPI_FLAGS, jspi: true },
+	'asyncify-tuned': { wasm: 'libext2fs-tuned.wasm', flags: [] },
+};
+
+// Whether node started with `flags` has JSPI, see jspiSupported in
+// lib/instance.js.
+function jspiAvailable(flags) {
+	const probe = spawnSync(process.execPath, [
+		...flags,
+		'-e',
+		"process.exit(typeof WebAssembly.Suspending === 'function' && typeof WebAssembly.promising === 'function' ? 0 : 1)",
+	]);
+	return probe.status === 0;
+}
+
+const DEFAULT_IMAGE = join(__dirname, '..', 'test', 'fixtures', 'ext4.img');
+
+// In-memory disk with asynchronous methods, so that every block request
+// suspends the wasm stack like a real backend would.
+class MemoryDisk {
+	constructor(image) {
+		this.image = Buffer.from(image);
+	}
+
+	async read(buffer, bufferOffset, length, fileOffset) {
+		return this.image.copy(buffer, bufferOffset, fileOffset, fileOffset + length);
+	}
+
+	async write(buffer, bufferOffset, length, fileOffset) {
+		return buffer.copy(this.image, fileOffset, bufferOffset, bufferOffset + length);
+	}
+
+	async discard() {
+	}
+
+	async flush() {
+	}
+}
+
+async function time(fn) {
+	const start = process.hrtime.bigint();
+	await fn();
+	return Number(process.hrtime.bigint() - start) / 1e6;
+}
+
+const WORKLOADS = {
+	'mount + umount x20': async (ext2fs, image) => {
+		for (let i = 0; i < 20; i++) {
+			await ext2fs.umount(await ext2fs.mount(new MemoryDisk(image)));
+		}
+	},
+	'write 500 small files': async (ext2fs, image) => {
+		await ext2fs.withMountedDisk(new MemoryDisk(image), 0, async ({ promises: fs }) => {
+			await fs.mkdir('/bench');
+			for (let i = 0; i < 500; i++) {
+				await fs.writeFile(`/bench/${i}`, `file ${i}\n`);
+			}
+		});
+	},
+	'write + read 4MiB in 64KiB chunks': async (ext2fs, image) => {
+		const chunk = Buffer.alloc(64 * 1024, 0x61);
+		await ext2fs.withMountedDisk(new MemoryDisk(image), 0, async ({ promises: fs }) => {
+			const handle = await fs.open('/bench_big', 'w+');
+			for (let i = 0; i < 64; i++) {
+				await handle.write(chunk, 0, chunk.length, i * chunk.length);
+			}
+			for (let i = 0; i < 64; i++) {
+				await handle.read(chunk, 0, chunk.length, i * chunk.length);
+			}
+			await handle.close();
+		});
+	},
+	'readdir + stat x200': async (ext2fs, image) => {
+		await ext2fs.withMountedDisk(new MemoryDisk(image), 0, async ({ promises: fs }) => {
+			for (let i = 0; i < 200; i++) {
+				for (const name of await fs.readdir('/')) {
+					await fs.lstat(`/${name}`);
+				}
+			}
+		});
+	},
+};
+
+async function runWorkloads(imagePath) {
+	const ext2fs = require('..');
+	const image = readFileSync(imagePath);
+	const result = { build: ext2fs.build, workloads: {} };
+	// Warm up: compiles the module and fills the code caches.
+	await ext2fs.umount(await ext2fs.mount(new MemoryDisk(image)));
+	for (const [name, fn] of Object.entries(WORKLOADS)) {
+		result.workloads[name] = await time(() => fn(ext2fs, image));
+	}
+	process.stdout.write(JSON.stringify(result));
+}
+
+function main() {
+	const imagePath = process.argv[2] || DEFAULT_IMAGE;
+	const results = [];
+	for (const [build, { wasm, flags, jspi }] of Object.entries(BUILDS)) {
+		const wasmPath = join(__dirname, '..', 'lib', wasm);
+		if (!existsSync(wasmPath)) {
+			console.log(`${build}: not built, skipped`);
+			continue;
+		}
+		if (jspi && !jspiAvailable(flags)) {
+			console.log(`${build}: JSPI not supported by this runtime, skipped`);
+			continue;
+		}
+		const child = spawnSync(process.execPath, [...flags, __filename, '--run', imagePath], {
+			env: Object.assign({}, process.env, { EXT2FS_BUILD: build }),
+			encoding: 'utf8',
+		});
+		if (child.status !== 0) {
+			const reason = child.error || (child.signal ? `signal ${child.signal}` : `exit code ${child.status}`);
+			console.log(`${build}: failed (${reason})`);
+			process.stderr.write(child.stderr);
+			process.exitCode = 1;
+			continue;
+		}
+		const result = JSON.parse(child.stdout);
+		result.wasmSize = statSync(wasmPath).size;
+		results.push(result);
+	}
+	for (const { build, wasmSize, workloads } of results) {
+		console.log(`${build} (wasm ${(wasmSize / 1024).toFixed(0)} KiB)`);
+		for (const [name, ms] of Object.entries(workloads)) {
+			console.log(`  ${name.padEnd(36)} ${ms.toFixed(1).padStart(10)} ms`);
+		}
+	}
+}
+
+if (process.argv[2] === '--run') {
+	runWorkloads(process.argv[3]).catch((error) => {
+		console.error(error);
+		process.exit(1);
+	});
+} else {
+	main();
+}
@@ -2,7 +2,7 @@
 
 set -ex
 
-TOOLCHAIN_VERSION=3.1.5
+TOOLCHAIN_VERSION=3.1.64
 
 # On macOS, make sure you have Xcode Command Line Tools installed.
 #
@@ -1,5 +1,10 @@
 'use strict';
 
+const DISK_CAP_ZEROOUT = 0x0001;
+const DISK_CAP_READSYNC = 0x0002;
+const DISK_CAP_WRITESYNC = 0x0004;
+const DISK_CAP_FLUSHSYNC = 0x0008;
+
 class DiskWrapper {
 	constructor(disk, offset=0) {
 		this.disk = disk;
@@ -14,13 +19,89 @@ class DiskWrapper {
 		return await this.disk.write(buffer, bufferOffset, length, fileOffset + this.offset);
 	}
 
+	// Synchronous variants, only used when the backend implements them, see
+	// capabilities().
+	readSync(buffer, bufferOffset, length, fileOffset) {
+		return this.disk.readSync(buffer, bufferOffset, length, fileOffset + this.offset);
+	}
+
+	writeSync(buffer, bufferOffset, length, fileOffset) {
+		return this.disk.writeSync(buffer, bufferOffset, length, fileOffset + this.offset);
+	}
+
+	// `chunks` is an array of `{ buffer, offset }`, sorted by offset and not
+	// overlapping. Backends that can write several chunks at once may
+	// implement `writev(chunks)`, otherwise chunks are written one by one.
+	async writev(chunks) {
+		if (typeof this.disk.writev === 'function') {
+			return await this.disk.writev(chunks.map(({ buffer, offset }) => ({
+				buffer,
+				offset: offset + this.offset,
+			})));
+		}
+		for (const { buffer, offset } of chunks) {
+			await this.write(buffer, 0, buffer.length, offset);
+		}
+	}
+
+	writevSync(chunks) {
+		for (const { buffer, offset } of chunks) {
+			this.writeSync(buffer, 0, buffer.length, offset);
+		}
+	}
+
 	async discard(offset, length) {
 		return await this.disk.discard(offset + this.offset, length);
 	}
 
+	// `ranges` is an array of `{ offset, length }`, sorted by offset and not
+	// overlapping. Backends that can discard several ranges at once may
+	// implement `discardMany(ranges)`, otherwise ranges are discarded one by
+	// one.
+	async discardMany(ranges) {
+		if (typeof this.disk.discardMany === 'function') {
+			return await this.disk.discardMany(ranges.map(({ offset, length }) => ({
+				offset: offset + this.offset,
+				length,
+			})));
+		}
+		for (const { offset, length } of ranges) {
+			await this.discard(offset, length);
+		}
+	}
+
+	// Overwrites `length` bytes at `offset` with zeroes, only available when
+	// the backend implements `zeroOut(offset, length)`.
+	async zeroOut(offset, length) {
+		return await this.disk.zeroOut(offset + this.offset, length);
+	}
+
+	// Bit field of the optional methods the backend implements, the values
+	// must match the DISK_CAP_* constants in src/glue.c.
+	capabilities() {
+		let result = 0;
+		if (typeof this.disk.zeroOut === 'function') {
+			result |= DISK_CAP_ZEROOUT;
+		}
+		if (typeof this.disk.readSync === 'function') {
+			result |= DISK_CAP_READSYNC;
+		}
+		if (typeof this.disk.writeSync === 'function') {
+			result |= DISK_CAP_WRITESYNC;
+		}
+		if (typeof this.disk.flushSync === 'function') {
+			result |= DISK_CAP_FLUSHSYNC;
+		}
+		return result;
+	}
+
 	async flush() {
 		return await this.disk.flush();
 	}
+
+	flushSync() {
+		return this.disk.flushSync();
+	}
 }
 
 exports.DiskWrapper = DiskWrapper;
@@ -0,0 +1,37 @@
+'use strict';
+
+// Splits the C exports (the EXPORTS list of the Makefile) between the ones
+// that may suspend on a disk request and the ones that never do: the JSPI
+// build only wraps the former, see the Makefile. Every export that touches the filesystem may read a block,
+// so only the allocator is synchronous. `make tuned` checks this list against
+// the call graph of the module, see scripts/asyncify-only.js.
+
+// Exports that may suspend on a disk request.
+exports.ASYNC_EXPORTS = new Set([
+	'node_ext2fs_mount',
+	'node_ext2fs_trim',
+	'node_ext2fs_batch',
+	'node_ext2fs_readdir',
+	'node_ext2fs_open',
+	'node_ext2fs_read',
+	'node_ext2fs_write',
+	'node_ext2fs_unlink',
+	'node_ext2fs_rename',
+	'node_ext2fs_link',
+	'node_ext2fs_rmdir',
+	'node_ext2fs_chmod',
+	'node_ext2fs_chown',
+	'node_ext2fs_mkdir',
+	'node_ext2fs_readlink',
+	'node_ext2fs_symlink',
+	'node_ext2fs_close',
+	'node_ext2fs_umount',
+	'node_ext2fs_fstat',
+	'node_ext2fs_stat',
+]);
+
+// Exports that never suspend.
+exports.SYNC_EXPORTS = new Set([
+	'malloc_from_js',
+	'free_from_js',
+]);
@@ -2,43 +2,195 @@
 
 const { DiskWrapper } = require('./disk');
 const createFs = require('./fs');
-const Module = require('./libext2fs');
-const { ccallThrowAsync } = require('./util');
+const { build, createInstance, getSharedInstance } = require('./instance');
+const { allocIoStats, decodeIoStats, freeIoStats, ioStatsView } = require('./stats');
+const { Arena, callExportThrowAsync, useBuffer, withHooks, withQueueOptions } = require('./util');
+const { Pool } = require('./pool');
+const { MountWorker, getWorkerUmount, mountInWorker } = require('./worker');
 
-const ready = new Promise((resolve) => {
-	Module.onRuntimeInitialized = resolve;
-});
 
-exports.mount = async function(disk, offset = 0) {
-	await ready;
+// Mount options that are passed to the C io manager as io_options,
+// see js_set_option_entry in src/glue.c.
+const IO_OPTIONS = [
+	['cacheSize', 'cache_size'],
+	['readahead', 'readahead'],
+	['dirtySize', 'dirty_size'],
+	['discardGranularity', 'discard_granularity'],
+	['yieldInterval', 'yield_interval'],
+	['dentryCacheSize', 'dentry_cache'],
+	['inodeCacheSize', 'inode_cache'],
+];
+
+function getIoOptions(options) {
+	const ioOptions = [];
+	for (const [name, ioName] of IO_OPTIONS) {
+		const value = options[name];
+		if (value === undefined) {
+			continue;
+		}
+		if (!Number.isInteger(value) || value < 0) {
+			throw new TypeError(`"${name}" option must be a non-negative integer`);
+		}
+		ioOptions.push(`${ioName}=${value}`);
+	}
+	return ioOptions.join('&');
+}
+
+// Calls `fn` with the object id of the `onProgress(done, max)` callback, or 0
+// without one, see js_progress_update in src/glue.c.
+async function withProgress(Module, onProgress, fn) {
+	if (onProgress === undefined) {
+		return await fn(0);
+	}
+	if (typeof onProgress !== 'function') {
+		throw new TypeError('"onProgress" option must be a function');
+	}
+	return await Module.withObjectId(onProgress, fn);
+}
+
+// The queue belongs to the instance, so the limit is only accepted for mounts
+// that have an instance of their own.
+function checkMaxQueueDepth({ maxQueueDepth, isolated, instance }) {
+	if (maxQueueDepth === undefined) {
+		return;
+	}
+	if (!(Number.isInteger(maxQueueDepth) && maxQueueDepth > 0)) {
+		throw new TypeError('"maxQueueDepth" option must be a positive integer');
+	}
+	if (!isolated || instance !== undefined) {
+		throw new TypeError('"maxQueueDepth" option requires "isolated"');
+	}
+}
+
+exports.mount = async function(disk, offset = 0, options = {}) {
+	checkMaxQueueDepth(options);
+	if (options.worker) {
+		// Validated here so that bad options fail before the worker starts.
+		getIoOptions(options);
+		// Functions can't be passed to the worker.
+		if (options.onProgress !== undefined) {
+			throw new TypeError('"onProgress" option is not available for worker mounts');
+		}
+		// Pools (lib/pool.js) pass the worker of the lane running the mount.
+		const mountWorker = options.worker instanceof MountWorker ? options.worker : undefined;
+		return await mountInWorker(disk, offset, Object.assign({}, options, { worker: false }), mountWorker);
+	}
+	let ioOptions = getIoOptions(options);
+	// With `isolated`, the mount gets its own WebAssembly instance and
+	// operation queue, so that it never waits for operations on other mounts.
+	// Pools (lib/pool.js) pass the instance of the lane running the mount.
+	const instance = await (options.instance || (options.isolated ? createInstance(options) : getSharedInstance()));
+	const { Module, queue } = instance;
+	const statsPointer = allocIoStats(Module);
+	ioOptions += `${ioOptions ? '&' : ''}stats=${statsPointer}`;
 	const wrapper = new DiskWrapper(disk, offset);
 	const diskId = Module.setObject(wrapper);
+	// The io options string is staged in the arena of the mount.
+	const arena = new Arena(instance);
 	let fsPointer;
 	try {
-		fsPointer = await ccallThrowAsync('node_ext2fs_mount', 'number', ['number'], [diskId]);
+		fsPointer = await withProgress(Module, options.onProgress, withHooks(async (progressId) => {
+			const encoded = Buffer.from(`${ioOptions}\u0000`);
+			const [buffer, ioOptionsPointer] = await useBuffer(encoded.length);
+			encoded.copy(buffer);
+			return await callExportThrowAsync(
+				instance,
+				'node_ext2fs_mount',
+				Module._node_ext2fs_mount,
+				[diskId, ioOptionsPointer, options.readOnly ? 1 : 0, progressId],
+			);
+		}, arena));
 	} catch (error) {
+		arena.destroy();
 		Module.deleteObject(diskId);
+		freeIoStats(Module, statsPointer);
 		throw error;
 	}
-	const fs = createFs(fsPointer);
-	fs.trim = fs.promises.trim = async () => {
-		await ccallThrowAsync('node_ext2fs_trim', 'number', ['number'], [fsPointer]);
+	const fs = createFs(instance, fsPointer, { arena, readOnly: Boolean(options.readOnly) });
+	// Like the FITRIM ioctl: discards the free ranges of at least `minLength`
+	// bytes within [start, start + length) and resolves with the number of
+	// bytes discarded. `onProgress` is called with the blocks scanned.
+	fs.trim = fs.promises.trim = async ({ start = 0, length = Infinity, minLength = 0, onProgress } = {}) => {
+		for (const [name, value] of Object.entries({ start, length, minLength })) {
+			if (typeof value !== 'number' || !(value >= 0)) {
+				throw new TypeError(`"${name}" option must be a positive number`);
+			}
+		}
+		return await withProgress(Module, onProgress, (progressId) => {
+			return callExportThrowAsync(
+				instance,
+				'node_ext2fs_trim',
+				Module._node_ext2fs_trim,
+				[fsPointer, start, length, minLength, progressId],
+			);
+		});
+	};
+	// Disk requests made by this mount, see decodeIoStats in lib/stats.js.
+	// Still available after umount, which also resolves with them.
+	let finalIoStats;  // copy taken on umount, when the buffer is freed
+	const ioStatsFields = () => finalIoStats || ioStatsView(Module, statsPointer);
+	fs.getIoStats = fs.promises.getIoStats = () => decodeIoStats(ioStatsFields());
+	fs.resetIoStats = fs.promises.resetIoStats = () => {
+		ioStatsFields().fill(0);
+	};
+	fs.releaseIoStats = () => {
+		finalIoStats = ioStatsView(Module, statsPointer).slice();
+		freeIoStats(Module, statsPointer);
+	};
+	// Operation queue of the instance, shared with the other non isolated
+	// mounts, see lib/queue.js.
+	fs.getQueueMetrics = fs.promises.getQueueMetrics = () => queue.getMetrics();
+	fs.resetQueueMetrics = fs.promises.resetQueueMetrics = () => {
+		queue.resetMetrics();
 	};
 	fs.diskId = fs.promises.diskId = diskId;
+	fs.readOnly = fs.promises.readOnly = Boolean(options.readOnly);
 	return fs;
 };
 
 exports.umount = async function(fs) {
-	await fs.closeAllFileDescriptors();
-	await ccallThrowAsync('node_ext2fs_umount', 'number', ['number'], [fs.fsPointer]);
-	Module.deleteObject(fs.diskId);
+	const umountWorker = getWorkerUmount(fs);
+	if (umountWorker !== undefined) {
+		return await umountWorker();
+	}
+	// Neither aborted nor rejected by a full queue, see lib/queue.js.
+	await withQueueOptions({ critical: true }, async () => {
+		await fs.closeAllFileDescriptors();
+		const { instance, fsPointer } = fs;
+		await callExportThrowAsync(instance, 'node_ext2fs_umount', instance.Module._node_ext2fs_umount, [fsPointer]);
+	});
+	// Calls that were already running may still hold arena blocks.
+	await fs.arena.drain();
+	fs.arena.destroy();
+	fs.releaseIoStats();
+	fs.instance.Module.deleteObject(fs.diskId);
+	return fs.getIoStats();
 };
 
-exports.withMountedDisk = async function(disk, offset, fn) {
-	const fs = await exports.mount(disk, offset);
+exports.withMountedDisk = async function(disk, offset, options, fn) {
+	if (typeof options === 'function') {
+		fn = options;
+		options = {};
+	}
+	const fs = await exports.mount(disk, offset, options);
 	try {
 		return await fn(fs);
 	} finally {
 		await exports.umount(fs);
 	}
 };
+
+// Runs withMountedDisk jobs on several WebAssembly instances or worker
+// threads, see lib/pool.js.
+exports.createPool = function(options) {
+	return new Pool(exports.withMountedDisk, options);
+};
+
+// Calls made by `fn` that are still queued when `signal` fires are dropped
+// and rejected with an AbortError, see lib/queue.js.
+exports.withSignal = function(signal, fn) {
+	return withQueueOptions({ signal }, fn);
+};
+
+// Name of the wasm build in use, `asyncify` or `jspi`.
+exports.build = build;
@@ -2,6 +2,7 @@
 // allowed in strict mode. Use ES6-style octal literals instead (`0o666`).
 
 'use strict';
+/*global BigInt*/
 
 const Buffer = require('buffer').Buffer;
 const Stream = require('stream').Stream;
@@ -13,12 +14,15 @@ const {
   usePath,
   useBuffer,
   usePaths,
-  withHooks,
+  withHooks: withArenaHooks,
   useObject,
+  encodePath,
+  withQueueOptions,
+  Arena,
 } = require('./util');
 const { callbackify } = require('util');
 const assert = require('assert');
-const binding = require('./binding');
+const createBinding = require('./binding');
 
 const Readable = Stream.Readable;
 const Writable = Stream.Writable;
@@ -146,6 +150,9 @@ function isFd(path) {
   return (path >>> 0) === path;
 }
 
+// Times are given like in node's Stats: `*Ms` in milliseconds, with a
+// fraction, and optionally `*Ns` as BigInt nanoseconds like node's
+// BigIntStats, the full precision of the inode.
 class Stats {
   constructor(
     dev,
@@ -158,10 +165,14 @@ class Stats {
     ino,
     size,
     blocks,
-    atim_msec,
-    mtim_msec,
-    ctim_msec,
-    birthtim_msec) {
+    atimeMs,
+    mtimeMs,
+    ctimeMs,
+    birthtimeMs,
+    atimeNs = msToNs(atimeMs),
+    mtimeNs = msToNs(mtimeMs),
+    ctimeNs = msToNs(ctimeMs),
+    birthtimeNs = msToNs(birthtimeMs)) {
     this.dev = dev;
     this.mode = mode;
     this.nlink = nlink;
@@ -172,10 +183,18 @@ class Stats {
     this.ino = ino;
     this.size = size;
     this.blocks = blocks;
-    this.atime = new Date(atim_msec);
-    this.mtime = new Date(mtim_msec);
-    this.ctime = new Date(ctim_msec);
-    this.birthtime = new Date(birthtim_msec);
+    this.atimeMs = atimeMs;
+    this.mtimeMs = mtimeMs;
+    this.ctimeMs = ctimeMs;
+    this.birthtimeMs = birthtimeMs;
+    this.atimeNs = atimeNs;
+    this.mtimeNs = mtimeNs;
+    this.ctimeNs = ctimeNs;
+    this.birthtimeNs = birthtimeNs;
+    this.atime = new Date(atimeMs);
+    this.mtime = new Date(mtimeMs);
+    this.ctime = new Date(ctimeMs);
+    this.birthtime = new Date(birthtimeMs);
   }
   _checkModeProperty(property) {
     return ((this.mode & constants.S_IFMT) === property);
@@ -210,6 +229,108 @@ class Stats {
   };
 };
 
+class Dirent {
+  constructor(name, type, path) {
+    this.name = name;
+    this.parentPath = path;
+    this.path = path;
+    this._type = type;  // S_IFMT bits
+  }
+
+  _checkModeProperty(property) {
+    return this._type === property;
+  }
+
+  isDirectory() {
+    return this._checkModeProperty(constants.S_IFDIR);
+  }
+
+  isFile() {
+    return this._checkModeProperty(constants.S_IFREG);
+  }
+
+  isBlockDevice() {
+    return this._checkModeProperty(constants.S_IFBLK);
+  }
+
+  isCharacterDevice() {
+    return this._checkModeProperty(constants.S_IFCHR);
+  }
+
+  isSymbolicLink() {
+    return this._checkModeProperty(constants.S_IFLNK);
+  }
+
+  isFIFO() {
+    return this._checkModeProperty(constants.S_IFIFO);
+  }
+
+  isSocket() {
+    return this._checkModeProperty(constants.S_IFSOCK);
+  }
+}
+
+// Layout of struct node_ext2fs_stat in src/glue.h, every field is a double.
+const STAT_FIELDS = 14;
+
+const NS_PER_SEC = BigInt(1e9);
+
+function msToNs(ms) {
+  return BigInt(Math.round(ms * 1e6));
+}
+
+// Times come as seconds and nanoseconds: the milliseconds keep as much of
+// the nanoseconds as a double can, the BigInt nanoseconds all of them.
+function statsFromFields(fields) {
+  const [
+    ino, mode, nlink, uid, gid, size, blocks, blksize,
+    atime, mtime, ctime, atimeNsec, mtimeNsec, ctimeNsec,
+  ] = fields;
+  const ms = (sec, nsec) => sec * 1000 + nsec / 1e6;
+  const ns = (sec, nsec) => BigInt(sec) * NS_PER_SEC + BigInt(nsec);
+  return new Stats(
+    0,  // dev
+    mode,
+    nlink,
+    uid,
+    gid,
+    0,  // rdev
+    blksize,
+    ino,
+    size,
+    blocks,
+    ms(atime, atimeNsec),
+    ms(mtime, mtimeNsec),
+    ms(ctime, ctimeNsec),
+    ms(ctime, ctimeNsec),
+    ns(atime, atimeNsec),
+    ns(mtime, mtimeNsec),
+    ns(ctime, ctimeNsec),
+    ns(ctime, ctimeNsec),
+  );
+}
+
+// The inverse of statsFromFields, so that Stats can cross a thread boundary
+// as the raw fields and come out identical on the other side.
+function fieldsFromStats(stats) {
+  const secNsec = (ns) => [Number(ns / NS_PER_SEC), Number(ns % NS_PER_SEC)];
+  const [atime, atimeNsec] = secNsec(stats.atimeNs);
+  const [mtime, mtimeNsec] = secNsec(stats.mtimeNs);
+  const [ctime, ctimeNsec] = secNsec(stats.ctimeNs);
+  return [
+    stats.ino, stats.mode, stats.nlink, stats.uid, stats.gid, stats.size,
+    stats.blocks, stats.blksize, atime, mtime, ctime,
+    atimeNsec, mtimeNsec, ctimeNsec,
+  ];
+}
+
+// Operations of fs.batch, see node_ext2fs_batch in src/glue.c. Every entry of
+// the ops array is two ints: the operation and the offset of its path, every
+// result is an errno, a readlink target index and a node_ext2fs_stat.
+const BATCH_OPS = { stat: 0, lstat: 1, readlink: 2 };
+const BATCH_OP_SIZE = 8;
+const BATCH_RESULT_FIELDS = 2 + STAT_FIELDS;
+
 function modeNum(m, def) {
   if (typeof m === 'number')
     return m;
@@ -245,8 +366,12 @@ class UnimplementedError extends Error {
 }
 
 
-module.exports = fsPointer => {
+// `arena` defaults to a new one, `readOnly` tells whether the filesystem was
+// mounted without write access.
+module.exports = (instance, fsPointer, { arena = new Arena(instance), readOnly = false } = {}) => {
+const binding = createBinding(instance);
 const {
+  W_OK = 0,
   X_OK = 0,
   O_RDONLY,
   O_NOFOLLOW,
@@ -255,6 +380,10 @@ const {
   S_IXOTH,
 } = constants;
 
+// Staging memory for the paths and I/O buffers of this mount, freed on umount.
+// lib/ext2fs.js passes the one it staged the mount options in.
+const withHooks = fn => withArenaHooks(fn, arena);
+
 // TODO(zwhitchcox): Should keep track of position in file here
 const openFiles = new Map();
 async function closeAllFileDescriptors() {
@@ -274,11 +403,15 @@ const DEBUG = process.env.NODE_DEBUG && /fs/.test(process.env.NODE_DEBUG);
 const EXECUTE_ABILITY = (S_IXUSR | S_IXGRP | S_IXOTH);
 const access = async (path, mode) => {
   // we know we can read/write being that we control the file
-  // so we just need to check that the file exists and maybe execution ability
+  // so we just need to check that the file exists, maybe execution ability,
+  // and that writing is allowed by the mount
   const stats = await stat(path);
   if (((mode & X_OK) !== 0) && ((stats.mode & EXECUTE_ABILITY) === 0)) {
     throw new ErrnoException(CODE_TO_ERRNO['EACCES'], 'access', [path, mode]);
   }
+  if (((mode & W_OK) !== 0) && readOnly) {
+    throw new ErrnoException(CODE_TO_ERRNO['EROFS'], 'access', [path, mode]);
+  }
 };
 
 const open = withHooks(async (path, flags, mode) => {
@@ -293,7 +426,8 @@ const open = withHooks(async (path, flags, mode) => {
 
 async function close(fd) {
   checkFd(fd, 'close', [fd]);
-  await binding.close(fd);
+  // Not affected by the queue limits, see lib/queue.js.
+  await withQueueOptions({ critical: true }, () => binding.close(fd));
   openFiles.delete(fd);
 }
 
@@ -494,51 +628,71 @@ const mkdtemp = withHooks(async (prefix, options) => {
   throw new UnimplementedError('mkdtemp');;
 });
 
-const readdir = withHooks(async (path, options) => {
+// Records of node_ext2fs_readdir: a struct node_ext2fs_dirent (inode number,
+// file type, name length) followed by the name.
+const DIRENT_HEADER_SIZE = 6;
+
+// Mode bits of the EXT2_FT_* file types.
+const DIRENT_TYPES = [
+  0,
+  constants.S_IFREG,
+  constants.S_IFDIR,
+  constants.S_IFCHR,
+  constants.S_IFBLK,
+  constants.S_IFIFO,
+  constants.S_IFSOCK,
+  constants.S_IFLNK,
+];
+
+const readdir = withHooks(async (dirPath, options) => {
   options = getOptions(options, {encoding: 'utf8'});
-  path = await usePath(path);
-  const [entries, entriesId] = await useObject([]);
-  await binding.readdir(fsPointer, path, entriesId);
-  if (options.encoding === 'buffer') {
-    return entries;
+  const path = await usePath(dirPath);
+  const [buffers, buffersId] = await useObject([]);
+  await binding.readdir(fsPointer, path, buffersId);
+  const [records] = buffers;
+  const entries = [];
+  let offset = 0;
+  while (offset < records.length) {
+    const type = records[offset + 4];
+    const nameLength = records[offset + 5];
+    offset += DIRENT_HEADER_SIZE;
+    let name = records.subarray(offset, offset + nameLength);
+    offset += nameLength;
+    if (options.encoding !== 'buffer') {
+      name = name.toString(options.encoding);
+    }
+    if (options.withFileTypes) {
+      entries.push(new Dirent(name, DIRENT_TYPES[type] || 0, dirPath));
+    } else {
+      entries.push(name);
+    }
   }
-  return entries.map((b) => b.toString(options.encoding));
+  return entries;
 });
 
 const fstat = withHooks(async (fd) => {
   checkFd(fd, 'fstat', [fd]);
-  const ctime = (await binding.stat_i_ctime(fd)) * 1000;
-  // TODO(zwhitchcox) get whole structure
-  return new Stats(...(await Promise.all([
-    0,   // dev
-    binding.stat_i_mode(fd),
-    binding.stat_i_links_count(fd),
-    binding.stat_i_uid(fd),
-    binding.stat_i_gid(fd),
-    0,  // rdev
-    binding.stat_blocksize(fd),
-    binding.stat_ino(fd),
-    binding.stat_i_size(fd),
-    binding.stat_i_blocks(fd),
-    binding.stat_i_atime(fd).then(x => x * 1000),
-    binding.stat_i_mtime(fd).then(x => x * 1000),
-    ctime,
-    ctime,
-  ])));
+  const [, statPointer] = await useBuffer(STAT_FIELDS * 8);
+  await binding.fstat(fd, statPointer);
+  const fields = instance.Module.HEAPF64.subarray(statPointer >> 3, (statPointer >> 3) + STAT_FIELDS);
+  return statsFromFields(fields);
+});
+
+// stat and lstat read the inode directly, without opening the file.
+const statPath = withHooks(async (path, follow) => {
+  path = await usePath(path);
+  const [, statPointer] = await useBuffer(STAT_FIELDS * 8);
+  await binding.stat(fsPointer, path, follow ? 1 : 0, statPointer);
+  const fields = instance.Module.HEAPF64.subarray(statPointer >> 3, (statPointer >> 3) + STAT_FIELDS);
+  return statsFromFields(fields);
 });
 
 async function lstat(path) {
-  const fd = await open(path, O_RDONLY | O_NOFOLLOW);
-  const stats = await fstat(fd);
-  await close(fd);
-  return stats;
+  return await statPath(path, false);
 };
 
 async function stat(path) {
-  const fd = await open(path, 'r', 0);
-  const stats = await fstat(fd);
-  await close(fd);
-  return stats;
+  return await statPath(path, true);
 }
 
 const readlink = withHooks(async (path, options) => {
@@ -553,6 +707,44 @@ const readlink = withHooks(async (path, options) => {
   return encoding === 'buffer' ? target : target.toString(encoding);
 });
 
+// Runs many stat, lstat and readlink operations in a single call into the
+// wasm module. Resolves to one `{ value }` or `{ error }` per operation.
+const batch = withHooks(async (operations) => {
+  const paths = operations.map(({ op, path }) => {
+    if (BATCH_OPS[op] === undefined) {
+      throw new Error(`Unsupported batch operation: ${op}`);
+    }
+    return encodePath(path);
+  });
+  const opsSize = operations.length * BATCH_OP_SIZE;
+  const pathsSize = paths.reduce((total, path) => total + path.length, 0);
+  const [, opsPointer] = await useBuffer(opsSize + pathsSize);
+  const [, resultsPointer] = await useBuffer(operations.length * BATCH_RESULT_FIELDS * 8);
+  const [targets, targetsId] = await useObject([]);
+  // Views are taken once everything is allocated, a malloc may grow the memory.
+  const input = instance.Module.getBuffer(opsPointer, opsSize + pathsSize);
+  const ops = instance.Module.HEAPU32.subarray(opsPointer >> 2, (opsPointer + opsSize) >> 2);
+  let offset = 0;
+  operations.forEach(({ op }, i) => {
+    ops[i * 2] = BATCH_OPS[op];
+    ops[i * 2 + 1] = offset;
+    paths[i].copy(input, opsSize + offset);
+    offset += paths[i].length;
+  });
+  await binding.batch(fsPointer, opsPointer, opsPointer + opsSize, operations.length, resultsPointer, targetsId);
+  // HEAPF64 may have been replaced by a memory growth during the call.
+  const results = instance.Module.HEAPF64.subarray(resultsPointer >> 3);
+  return operations.map(({ op, path }, i) => {
+    const fields = results.subarray(i * BATCH_RESULT_FIELDS, (i + 1) * BATCH_RESULT_FIELDS);
+    if (fields[0] < 0) {
+      return { error: new ErrnoException(-fields[0], op, [path]) };
+    }
+    if (op === 'readlink') {
+      return { value: targets[fields[1]].toString() };
+    }
+    return { value: statsFromFields(fields.subarray(2)) };
+  });
+});
 
 const rename = withHooks(async (existingPath, newPath) => {
   existingPath = await usePath(existingPath);
@@ -648,7 +840,18 @@ async function writeAll(fd, buffer, offset, length, position) {
 
 const kReadFileBufferLength = 8 * 1024;
 
-async function readFile(path, options) {
+// Runs `fn` with the AbortSignal of `options`, if any: queued operations
+// that have not started yet are dropped when it fires.
+function withSignal(options, fn) {
+  if (options !== null && typeof options === 'object' && options.signal !== undefined) {
+    return withQueueOptions({ signal: options.signal }, fn);
+  }
+  return fn();
+}
+
+const readFile = (path, options) => withSignal(options, () => readFileWithoutSignal(path, options));
+
+async function readFileWithoutSignal(path, options) {
   options = getOptions(options, {
     flag: 'r',
     encoding: 'utf8',
@@ -689,7 +892,9 @@ async function readFile(path, options) {
   }
 };
 
-async function writeFile(path, data, options) {
+const writeFile = (path, data, options) => withSignal(options, () => writeFileWithoutSignal(path, data, options));
+
+async function writeFileWithoutSignal(path, data, options) {
   const { flag, mode, encoding } = getOptions(options,
     { encoding: 'utf8', mode: 0o666, flag: 'w' });
   const fd = isFd(path) ? fd : await open(path, flag, mode);
@@ -1101,7 +1306,9 @@ async function openFileHandle(path, flags, mode) {
 }
 
 const fsPromises = {
+  instance,
   fsPointer,
+  arena,
   closeAllFileDescriptors,
   openFiles,
   constants,
@@ -1127,6 +1334,7 @@ const fsPromises = {
   lstat,
   stat,
   readlink,
+  batch,
   symlink,
   link,
   fchmod,
@@ -1142,7 +1350,9 @@ const fsPromises = {
 }
 
 const fs = {
+  instance,
   fsPointer,
+  arena,
   closeAllFileDescriptors,
   openFiles,
   constants,
@@ -1168,6 +1378,7 @@ const fs = {
   lstat: callbackify(lstat),
   stat: callbackify(stat),
   readlink: callbackify(readlink),
+  batch: callbackify(batch),
   symlink: callbackify(symlink),
   link: callbackify(link),
   fchmod: callbackify(fchmod),
@@ -1197,3 +1408,8 @@ for (const _fs of [fs, fsPromises]) {
 fs.promises = fsPromises;
 return fs;
 };
+
+module.exports.Stats = Stats;
+module.exports.Dirent = Dirent;
+module.exports.statsFromFields = statsFromFields;
+module.exports.fieldsFromStats = fieldsFromStats;
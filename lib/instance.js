@@ -0,0 +1,96 @@
+'use strict';
+/*global WebAssembly*/
+
+const { existsSync, readFileSync } = require('fs');
+const { join } = require('path');
+
+const { Queue } = require('./queue');
+
+// Builds produced by the Makefile: `asyncify` works everywhere, `jspi` needs
+// WebAssembly JS Promise Integration. `asyncify-tuned` (`make tuned`) only
+// instruments the functions that can reach a disk request, it is never
+// picked automatically.
+const BUILDS = {
+	asyncify: 'libext2fs',
+	jspi: 'libext2fs-jspi',
+	'asyncify-tuned': 'libext2fs-tuned',
+};
+
+function jspiSupported() {
+	return typeof WebAssembly.Suspending === 'function' && typeof WebAssembly.promising === 'function';
+}
+
+// The EXT2FS_BUILD environment variable forces a build, otherwise the JSPI
+// one is used when the runtime supports it and it has been built.
+function selectBuild() {
+	const build = process.env.EXT2FS_BUILD;
+	if (build !== undefined && build !== '') {
+		if (BUILDS[build] === undefined) {
+			throw new Error(`Unknown EXT2FS_BUILD "${build}", expected one of ${Object.keys(BUILDS).join(', ')}`);
+		}
+		return build;
+	}
+	if (jspiSupported() && existsSync(join(__dirname, `${BUILDS.jspi}.wasm`))) {
+		return 'jspi';
+	}
+	return 'asyncify';
+}
+
+const build = selectBuild();
+exports.build = build;
+
+const createExt2fsModule = require(`./${BUILDS[build]}`);
+
+let wasmModule;
+
+// The wasm binary of the selected build is compiled once, every instance
+// created from it has its own memory, objects map and operation queue.
+function getWasmModule() {
+	if (wasmModule === undefined) {
+		wasmModule = new WebAssembly.Module(readFileSync(join(__dirname, `${BUILDS[build]}.wasm`)));
+	}
+	return wasmModule;
+}
+
+// `maxQueueDepth` limits the operation queue of the instance, see
+// lib/queue.js.
+async function createInstance({ maxQueueDepth } = {}) {
+	const compiled = getWasmModule();
+	// The module promise never settles if instantiateWasm fails
+	// asynchronously, such failures reject this one instead.
+	let instantiationFailed;
+	const failure = new Promise((resolve, reject) => {
+		instantiationFailed = reject;
+	});
+	const Module = await Promise.race([
+		createExt2fsModule({
+			instantiateWasm(imports, receiveInstance) {
+				WebAssembly.instantiate(compiled, imports).then((instance) => {
+					receiveInstance(instance, compiled);
+				}).catch(instantiationFailed);
+				return {};
+			},
+		}),
+		failure,
+	]);
+	return { Module, queue: new Queue({ maxDepth: maxQueueDepth }) };
+}
+exports.createInstance = createInstance;
+
+let sharedInstance;
+
+// Instance used by the mounts that don't ask for their own one.
+function getSharedInstance() {
+	if (sharedInstance === undefined) {
+		const instance = createInstance();
+		sharedInstance = instance;
+		// Don't keep a failed instantiation, the next mount tries again.
+		instance.catch(() => {
+			if (sharedInstance === instance) {
+				sharedInstance = undefined;
+			}
+		});
+	}
+	return sharedInstance;
+}
+exports.getSharedInstance = getSharedInstance;
@@ -0,0 +1,173 @@
+'use strict';
+
+const { cpus } = require('os');
+
+const { createInstance } = require('./instance');
+const { MountWorker } = require('./worker');
+
+// Spreads jobs (a mount, a function run on it, an umount) over `concurrency`
+// lanes. Each lane has its own WebAssembly instance that its jobs reuse. With
+// `worker`, that instance lives in a worker thread of the lane, so that
+// libext2fs work runs on several cores.
+//
+// Every lane has a deque of jobs: a new job goes to the least loaded lane, a
+// lane takes jobs from the front of its own deque and, once it is empty,
+// steals from the back of the longest one.
+class Pool {
+	constructor(withMountedDisk, { concurrency = cpus().length, worker = false } = {}) {
+		if (!Number.isInteger(concurrency) || concurrency < 1) {
+			throw new TypeError('"concurrency" option must be a positive integer');
+		}
+		this.withMountedDisk = withMountedDisk;
+		this.worker = worker;
+		this.closed = false;
+		this.lanes = [];
+		for (let i = 0; i < concurrency; i++) {
+			this.lanes.push({
+				deque: [],
+				busy: false,
+				instance: undefined,
+				worker: undefined,
+				completed: 0,
+				failed: 0,
+				stolen: 0,
+			});
+		}
+		this.idle = Promise.resolve();
+		this.resolveIdle = undefined;
+	}
+
+	// Like withMountedDisk, on one of the lanes.
+	run(disk, offset, options, fn) {
+		if (typeof options === 'function') {
+			fn = options;
+			options = {};
+		}
+		if (this.closed) {
+			return Promise.reject(new Error('Pool is closed'));
+		}
+		return new Promise((resolve, reject) => {
+			const load = (lane) => lane.deque.length + (lane.busy ? 1 : 0);
+			const lane = this.lanes.reduce((best, lane) => (load(lane) < load(best) ? lane : best));
+			lane.deque.push({ disk, offset, options, fn, resolve, reject });
+			if (this.resolveIdle === undefined) {
+				this.idle = new Promise((resolve) => {
+					this.resolveIdle = resolve;
+				});
+			}
+			this.schedule();
+		});
+	}
+
+	// Runs `fn(fs, job)` for every `{ disk, offset, options }` job. Returns an
+	// async iterator of `{ index, job, value }` or `{ index, job, error }` in
+	// completion order.
+	map(jobs, fn) {
+		const pending = new Map();
+		jobs.forEach((job, index) => {
+			const { disk, offset = 0, options = {} } = job;
+			pending.set(index, this.run(disk, offset, options, (fs) => fn(fs, job)).then(
+				(value) => ({ index, job, value }),
+				(error) => ({ index, job, error }),
+			));
+		});
+		return {
+			[Symbol.asyncIterator]() {
+				return this;
+			},
+			async next() {
+				if (pending.size === 0) {
+					return { done: true, value: undefined };
+				}
+				const result = await Promise.race(pending.values());
+				pending.delete(result.index);
+				return { done: false, value: result };
+			},
+		};
+	}
+
+	takeJob(lane) {
+		if (lane.deque.length > 0) {
+			return lane.deque.shift();
+		}
+		const victim = this.lanes.reduce((longest, other) => (other.deque.length > longest.deque.length ? other : longest));
+		if (victim.deque.length === 0) {
+			return undefined;
+		}
+		lane.stolen += 1;
+		return victim.deque.pop();
+	}
+
+	schedule() {
+		for (const lane of this.lanes) {
+			if (lane.busy) {
+				continue;
+			}
+			const job = this.takeJob(lane);
+			if (job !== undefined) {
+				this.runJob(lane, job);
+			}
+		}
+		if (this.resolveIdle !== undefined && this.lanes.every((lane) => !lane.busy)) {
+			this.resolveIdle();
+			this.resolveIdle = undefined;
+		}
+	}
+
+	async runJob(lane, { disk, offset, options, fn, resolve, reject }) {
+		lane.busy = true;
+		try {
+			options = Object.assign({}, options);
+			if (this.worker) {
+				if (lane.worker === undefined || lane.worker.exited) {
+					lane.worker = new MountWorker();
+				}
+				options.worker = lane.worker;
+			} else {
+				if (lane.instance === undefined) {
+					lane.instance = createInstance();
+					lane.instance.catch(() => {
+						lane.instance = undefined;
+					});
+				}
+				options.instance = lane.instance;
+			}
+			resolve(await this.withMountedDisk(disk, offset, options, fn));
+			lane.completed += 1;
+		} catch (error) {
+			reject(error);
+			lane.failed += 1;
+		} finally {
+			lane.busy = false;
+			this.schedule();
+		}
+	}
+
+	// Jobs completed, failed and stolen by each lane, and the ones waiting in
+	// it.
+	getStats() {
+		return this.lanes.map(({ deque, busy, completed, failed, stolen }) => {
+			return { queued: deque.length, busy, completed, failed, stolen };
+		});
+	}
+
+	// Rejects the jobs that have not started and resolves once the running
+	// ones are done and the worker threads are stopped.
+	async close() {
+		this.closed = true;
+		for (const lane of this.lanes) {
+			for (const { reject } of lane.deque.splice(0)) {
+				reject(new Error('Pool is closed'));
+			}
+		}
+		this.schedule();
+		await this.idle;
+		for (const lane of this.lanes) {
+			if (lane.worker !== undefined) {
+				await lane.worker.terminate();
+				lane.worker = undefined;
+			}
+		}
+	}
+}
+exports.Pool = Pool;
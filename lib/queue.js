@@ -1,29 +1,132 @@
 'use strict';
 
-let running = false;
-const queue = [];
-
-async function run() {
-	running = true;
-	if (queue.length === 0) {
-		running = false;
-		return;
-	}
-	const { fn, args, resolve, reject } = queue.shift();
-	try {
-		resolve(await fn(...args));
-	} catch (error) {
-		reject(error);
-	} finally {
-		await run();
+const { CODE_TO_ERRNO } = require('./wasi');
+
+function abortError(signal) {
+	if (signal.reason !== undefined) {
+		return signal.reason;
 	}
+	const error = new Error('The operation was aborted');
+	error.name = 'AbortError';
+	error.code = 'ABORT_ERR';
+	return error;
 }
 
-exports.addOperation = function(fn, args) {
-	return new Promise((resolve, reject) => {
-		queue.push({ fn, args, resolve, reject });
-		if (!running) {
-			run();
+function queueFullError(maxDepth) {
+	const error = new Error(`Operation queue full (${maxDepth} pending operations)`);
+	error.code = 'EAGAIN';
+	error.errno = CODE_TO_ERRNO['EAGAIN'];
+	return error;
+}
+
+function emptyTimes() {
+	return { total: 0, max: 0 };
+}
+
+function addTime(times, ms) {
+	times.total += ms;
+	times.max = Math.max(times.max, ms);
+}
+
+// FIFO of operations, each one starts once the previous one has settled. A
+// WebAssembly instance can only run one Asyncify operation at a time, so every
+// instance has its own queue.
+//
+// At most `maxDepth` operations wait, further ones are rejected with EAGAIN.
+// Operations given an AbortSignal are dropped if it fires before they start.
+// `critical` operations (closing files, unmounting) ignore both so that
+// cleanups always run.
+class Queue {
+	constructor({ maxDepth = Infinity } = {}) {
+		this.maxDepth = maxDepth;
+		this.running = false;
+		this.queue = [];
+		this.resetMetrics();
+	}
+
+	async run() {
+		this.running = true;
+		while (this.queue.length > 0) {
+			const operation = this.queue.shift();
+			const { fn, args, resolve, reject, signal, enqueued } = operation;
+			if (signal !== undefined) {
+				signal.removeEventListener('abort', operation.onAbort);
+			}
+			const start = process.hrtime.bigint();
+			addTime(this.metrics.waitTime, Number(start - enqueued) / 1e6);
+			try {
+				resolve(await fn(...args));
+				this.metrics.completed += 1;
+			} catch (error) {
+				reject(error);
+				this.metrics.failed += 1;
+			}
+			addTime(this.metrics.serviceTime, Number(process.hrtime.bigint() - start) / 1e6);
 		}
-	});
-};
+		this.running = false;
+	}
+
+	addOperation(fn, args, { signal, critical = false } = {}) {
+		return new Promise((resolve, reject) => {
+			if (!critical) {
+				if (signal !== undefined && signal.aborted) {
+					this.metrics.aborted += 1;
+					reject(abortError(signal));
+					return;
+				}
+				if (this.queue.length >= this.maxDepth) {
+					this.metrics.rejected += 1;
+					reject(queueFullError(this.maxDepth));
+					return;
+				}
+			}
+			const operation = { fn, args, resolve, reject, enqueued: process.hrtime.bigint() };
+			if (!critical && signal !== undefined) {
+				operation.signal = signal;
+				operation.onAbort = () => {
+					const index = this.queue.indexOf(operation);
+					if (index !== -1) {
+						this.queue.splice(index, 1);
+						this.metrics.aborted += 1;
+						reject(abortError(signal));
+					}
+				};
+				signal.addEventListener('abort', operation.onAbort, { once: true });
+			}
+			this.queue.push(operation);
+			this.metrics.enqueued += 1;
+			this.metrics.peakDepth = Math.max(this.metrics.peakDepth, this.queue.length);
+			if (!this.running) {
+				this.run();
+			}
+		});
+	}
+
+	// Counters since creation or the last resetMetrics(), times are in
+	// milliseconds: `waitTime` is spent in the queue, `serviceTime` running.
+	// `depth` and `running` describe the queue right now.
+	getMetrics() {
+		const { waitTime, serviceTime } = this.metrics;
+		return Object.assign({}, this.metrics, {
+			depth: this.queue.length,
+			maxDepth: this.maxDepth,
+			running: this.running,
+			waitTime: Object.assign({}, waitTime),
+			serviceTime: Object.assign({}, serviceTime),
+		});
+	}
+
+	resetMetrics() {
+		this.metrics = {
+			enqueued: 0,
+			completed: 0,
+			failed: 0,
+			aborted: 0,
+			rejected: 0,
+			peakDepth: this.queue.length,
+			waitTime: emptyTimes(),
+			serviceTime: emptyTimes(),
+		};
+	}
+}
+exports.Queue = Queue;
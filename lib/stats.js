@@ -0,0 +1,58 @@
+'use strict';
+
+// Layout of struct js_io_stats in src/glue.c, every field is a double.
+const IO_STATS_OPS = ['read', 'write', 'discard', 'flush', 'zeroOut'];
+const IO_STATS_BUCKETS = 16;
+const OP_FIELDS = 7 + 2 * IO_STATS_BUCKETS;
+const IO_STATS_FIELDS = IO_STATS_OPS.length * OP_FIELDS + 3;
+const IO_STATS_SIZE = IO_STATS_FIELDS * 8;
+
+// Float64Array over the stats buffer at `pointer` in the memory of `Module`.
+function ioStatsView(Module, pointer) {
+	return Module.HEAPF64.subarray(pointer >> 3, (pointer >> 3) + IO_STATS_FIELDS);
+}
+exports.ioStatsView = ioStatsView;
+
+// Allocates a zeroed stats buffer for the `stats` io option. It is not freed
+// by the io manager so that it can still be read after umount.
+function allocIoStats(Module) {
+	const pointer = Module._malloc_from_js(IO_STATS_SIZE);
+	if (pointer === 0) {
+		throw new Error('Could not allocate the io stats buffer');
+	}
+	ioStatsView(Module, pointer).fill(0);
+	return pointer;
+}
+exports.allocIoStats = allocIoStats;
+
+function freeIoStats(Module, pointer) {
+	Module._free_from_js(pointer);
+}
+exports.freeIoStats = freeIoStats;
+
+function decodeIoStats(fields) {
+	const result = {};
+	IO_STATS_OPS.forEach((name, i) => {
+		const op = fields.subarray(i * OP_FIELDS, (i + 1) * OP_FIELDS);
+		const [calls, ranges, sequential, blocks, metadataBlocks, bytes, time] = op;
+		result[name] = {
+			calls,
+			ranges,
+			sequential,
+			random: ranges - sequential,
+			sequentialRatio: ranges ? sequential / ranges : 0,
+			blocks,
+			metadataBlocks,
+			dataBlocks: blocks - metadataBlocks,
+			bytes,
+			time,
+			latency: Array.from(op.subarray(7, 7 + IO_STATS_BUCKETS)),
+			sizes: Array.from(op.subarray(7 + IO_STATS_BUCKETS, 7 + 2 * IO_STATS_BUCKETS)),
+		};
+	});
+	result.cacheHits = fields[IO_STATS_OPS.length * OP_FIELDS];
+	result.cacheMisses = fields[IO_STATS_OPS.length * OP_FIELDS + 1];
+	result.zeroOutWrites = fields[IO_STATS_OPS.length * OP_FIELDS + 2];
+	return result;
+}
+exports.decodeIoStats = decodeIoStats;
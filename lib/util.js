@@ -1,8 +1,8 @@
 'use strict';
 
-const { ERRNO_TO_CODE } = require('./wasi');
-const Module = require('./libext2fs');
-const queue = require('./queue');
+const { AsyncLocalStorage } = require('async_hooks');
+
+const { CODE_TO_ERRNO, ERRNO_TO_CODE } = require('./wasi');
 
 class ErrnoException extends Error {
 	constructor(errno, syscall, args) {
@@ -16,8 +16,24 @@ class ErrnoException extends Error {
 }
 exports.ErrnoException = ErrnoException;
 
-async function ccallThrowAsync(name, returnType, argsType, args) {
-	const result = await queue.addOperation(Module.ccall, [name, returnType, argsType, args, { async: true }]);
+// Queue options (`signal`, `critical`, see lib/queue.js) of the calls made in
+// the current async context.
+const queueOptions = new AsyncLocalStorage();
+
+function withQueueOptions(options, fn) {
+	return queueOptions.run(options, fn);
+}
+exports.withQueueOptions = withQueueOptions;
+
+// `instance` is a `{ Module, queue }` pair from lib/instance.js: calls are
+// serialized per WebAssembly instance.
+async function ccallThrowAsync(instance, name, returnType, argsType, args) {
+	const { Module, queue } = instance;
+	const result = await queue.addOperation(
+		Module.ccall,
+		[name, returnType, argsType, args, { async: true }],
+		queueOptions.getStore(),
+	);
 	if (result < 0) {
 		throw new ErrnoException(-result, name, args);
 	}
@@ -25,8 +41,30 @@ async function ccallThrowAsync(name, returnType, argsType, args) {
 }
 exports.ccallThrowAsync = ccallThrowAsync;
 
-function ccallThrow(name, returnType, argsType, args) {
-	const result = Module.ccall(name, returnType, argsType, args);
+// Calls the wasm export `fn`, which may suspend: with
+// Asyncify it returns once the stack is unwound and Asyncify.whenDone()
+// resolves with the result, JSPI exports return a promise.
+function callExport(Module, fn, args) {
+	const result = fn(...args);
+	const { Asyncify } = Module;
+	if (Asyncify !== undefined && Asyncify.currData) {
+		return Asyncify.whenDone();
+	}
+	return result;
+}
+
+async function callExportThrowAsync(instance, name, fn, args) {
+	const { Module, queue } = instance;
+	const result = await queue.addOperation(callExport, [Module, fn, args], queueOptions.getStore());
+	if (result < 0) {
+		throw new ErrnoException(-result, name, args);
+	}
+	return result;
+}
+exports.callExportThrowAsync = callExportThrowAsync;
+
+function ccallThrow(instance, name, returnType, argsType, args) {
+	const result = instance.Module.ccall(name, returnType, argsType, args);
 	if (result < 0) {
 		throw new ErrnoException(-result, name, args);
 	}
@@ -71,25 +109,132 @@ const curHookId = () => {
 	return hookId;
 };
 
-const free = addr => ccallThrowAsync('free_from_js', 'void', ['number'], [addr]);
-const malloc = length => ccallThrowAsync('malloc_from_js', 'void', ['number'], [length]);
+const ARENA_MIN_SIZE = 64;
+// The heap has a fixed size and is shared by every mount of an instance, so
+// the idle blocks of all the arenas of an instance are bounded together, and
+// large blocks are never kept.
+const ARENA_MAX_IDLE = 256 * 1024;
+const ARENA_MAX_BLOCK = 64 * 1024;
+
+// Module -> bytes kept idle by all the arenas using its heap.
+const arenaIdle = new WeakMap();
+
+// Per-mount staging memory in the wasm heap for paths and I/O buffers.
+// Blocks are rounded up to a power of two and kept in per-size free lists when
+// released, so that hot calls reuse them instead of issuing malloc_from_js and
+// free_from_js ccalls. malloc_from_js and free_from_js never call into js, so
+// they are called directly: this is safe even while a queued operation is
+// suspended.
+class Arena {
+	constructor(instance) {
+		this.Module = instance.Module;
+		this.sizes = new Map();  // pointer -> size
+		this.pools = new Map();  // size -> idle pointers
+		this.idle = 0;
+		this.users = 0;  // calls running withHooks on this arena
+		this.drainWaiters = [];
+		if (!arenaIdle.has(this.Module)) {
+			arenaIdle.set(this.Module, 0);
+		}
+	}
+
+	addIdle(bytes) {
+		this.idle += bytes;
+		arenaIdle.set(this.Module, arenaIdle.get(this.Module) + bytes);
+	}
 
-function withHooks(fn) {
+	alloc(length) {
+		let size = ARENA_MIN_SIZE;
+		while (size < length) {
+			size *= 2;
+		}
+		const pool = this.pools.get(size);
+		if (pool !== undefined && pool.length > 0) {
+			this.addIdle(-size);
+			return pool.pop();
+		}
+		const pointer = this.Module._malloc_from_js(size);
+		if (pointer === 0) {
+			throw new ErrnoException(CODE_TO_ERRNO['ENOMEM'], 'malloc_from_js', [size]);
+		}
+		this.sizes.set(pointer, size);
+		return pointer;
+	}
+
+	release(pointer) {
+		const size = this.sizes.get(pointer);
+		if (size > ARENA_MAX_BLOCK || arenaIdle.get(this.Module) + size > ARENA_MAX_IDLE) {
+			this.sizes.delete(pointer);
+			this.Module._free_from_js(pointer);
+			return;
+		}
+		if (!this.pools.has(size)) {
+			this.pools.set(size, []);
+		}
+		this.pools.get(size).push(pointer);
+		this.addIdle(size);
+	}
+
+	enter() {
+		this.users += 1;
+	}
+
+	leave() {
+		this.users -= 1;
+		if (this.users === 0) {
+			for (const resolve of this.drainWaiters.splice(0)) {
+				resolve();
+			}
+		}
+	}
+
+	// Resolves once no call uses the arena anymore.
+	async drain() {
+		if (this.users > 0) {
+			await new Promise((resolve) => {
+				this.drainWaiters.push(resolve);
+			});
+		}
+	}
+
+	// Frees every block, the ones still in use included: only call this once
+	// the arena is drained and no operation can use it anymore.
+	destroy() {
+		for (const pointer of this.sizes.keys()) {
+			this.Module._free_from_js(pointer);
+		}
+		this.sizes.clear();
+		this.pools.clear();
+		this.addIdle(-this.idle);
+	}
+}
+exports.Arena = Arena;
+
+const arenas = new Map();
+
+// Buffers and objects used by `fn` belong to the instance of `arena`, they are
+// given back at the end of the call.
+function withHooks(fn, arena) {
 	return async (...args) => {
 		const oldHookId = hookId;
 		const _hookId = hookId = getHookId();
 		objIds.set(hookId, []);
 		memAddrs.set(hookId, []);
+		arenas.set(hookId, arena);
+		arena.enter();
 		try {
 			return await fn(...args);
 		} finally {
 			for (const objId of objIds.get(_hookId))
-				Module.deleteObject(objId);
-			await Promise.all(memAddrs.get(_hookId).map(free));
+				arena.Module.deleteObject(objId);
+			for (const addr of memAddrs.get(_hookId))
+				arena.release(addr);
 			objIds.delete(_hookId);
 			memAddrs.delete(_hookId);
+			arenas.delete(_hookId);
 			hookId = oldHookId;
 			releaseHookId(_hookId);
+			arena.leave();
 		}
 	};
 }
@@ -110,12 +255,17 @@ const rstripSlashesBuffer = buf => {
 	return buf.slice(0, end+1);
 };
 
-const usePath = async path => {
+// NUL terminated path as passed to C.
+const encodePath = path => {
 	checkPath(path);
-	path = rstripSlashesBuffer(Buffer.from(path));
-	const [buffer, pointer] = await useBuffer(path.length + 1);
+	return Buffer.concat([rstripSlashesBuffer(Buffer.from(path)), Buffer.alloc(1)]);
+};
+exports.encodePath = encodePath;
+
+const usePath = async path => {
+	path = encodePath(path);
+	const [buffer, pointer] = await useBuffer(path.length);
 	path.copy(buffer);
-	buffer[path.length] = 0;
 	return pointer;
 };
 exports.usePath = usePath;
@@ -125,8 +275,9 @@ exports.usePaths = usePaths;
 
 const useBuffer = async length => {
 	const _hookId = curHookId();
-	const pointer = await malloc(length);
-	const buffer = Module.getBuffer(pointer, length);
+	const arena = arenas.get(_hookId);
+	const pointer = arena.alloc(length);
+	const buffer = arena.Module.getBuffer(pointer, length);
 	memAddrs.get(_hookId).push(pointer);
 	hookId = _hookId;
 	return [buffer, pointer];
@@ -134,8 +285,9 @@ const useBuffer = async length => {
 exports.useBuffer = useBuffer;
 
 const useObject = async obj => {
-	const id = Module.setObject(obj);
-	objIds.get(curHookId()).push(id);
+	const _hookId = curHookId();
+	const id = arenas.get(_hookId).Module.setObject(obj);
+	objIds.get(_hookId).push(id);
 	return [obj, id];
 };
 
@@ -0,0 +1,129 @@
+'use strict';
+/*global SharedArrayBuffer*/
+
+// Entry point of the worker threads started by mountInWorker in
+// lib/worker.js.
+
+const { parentPort, workerData } = require('worker_threads');
+const { promisify } = require('util');
+
+const ext2fs = require('./ext2fs');
+const { CONTROL_DONE, CONTROL_STATUS, decode, encode, encodeError } = require('./worker');
+
+// Disk whose requests are run by the thread that owns the real disk. This
+// thread blocks on the control array until a request is done, so the
+// synchronous methods are provided and libext2fs never has to unwind the
+// stack for disk I/O. Data goes through a SharedArrayBuffer that grows with
+// the largest request.
+class RemoteDisk {
+	constructor(control, zeroOut) {
+		this.control = control;
+		this.data = new SharedArrayBuffer(64 * 1024);
+		if (zeroOut) {
+			this.zeroOut = async (offset, length) => {
+				this.request({ op: 'zeroOut', offset, length });
+			};
+		}
+	}
+
+	staging(length) {
+		if (this.data.byteLength < length) {
+			let size = this.data.byteLength;
+			while (size < length) {
+				size *= 2;
+			}
+			this.data = new SharedArrayBuffer(size);
+		}
+		return Buffer.from(this.data, 0, length);
+	}
+
+	request(request) {
+		Atomics.store(this.control, CONTROL_DONE, 0);
+		parentPort.postMessage({ disk: Object.assign({ data: this.data }, request) });
+		Atomics.wait(this.control, CONTROL_DONE, 0);
+		if (Atomics.load(this.control, CONTROL_STATUS) !== 0) {
+			throw new Error(`Disk ${request.op} failed`);
+		}
+	}
+
+	readSync(buffer, bufferOffset, length, fileOffset) {
+		const staging = this.staging(length);
+		this.request({ op: 'read', offset: fileOffset, length });
+		staging.copy(buffer, bufferOffset);
+		return length;
+	}
+
+	writeSync(buffer, bufferOffset, length, fileOffset) {
+		const staging = this.staging(length);
+		buffer.copy(staging, 0, bufferOffset, bufferOffset + length);
+		this.request({ op: 'write', offset: fileOffset, length });
+		return length;
+	}
+
+	flushSync() {
+		this.request({ op: 'flush' });
+	}
+
+	async read(...args) {
+		return this.readSync(...args);
+	}
+
+	async write(...args) {
+		return this.writeSync(...args);
+	}
+
+	async flush() {
+		this.flushSync();
+	}
+
+	async discard(offset, length) {
+		this.request({ op: 'discard', offset, length });
+	}
+
+	async discardMany(ranges) {
+		this.request({ op: 'discardMany', ranges });
+	}
+}
+
+// The current mount. A thread holds one mount at a time but can mount again
+// after umount, see MountWorker in lib/worker.js.
+let fs;
+
+const methods = {
+	async mount(offset, options, zeroOut) {
+		const disk = new RemoteDisk(workerData.control, zeroOut);
+		fs = await ext2fs.mount(disk, offset, options);
+	},
+	async umount() {
+		try {
+			return await ext2fs.umount(fs);
+		} finally {
+			fs = undefined;
+		}
+	},
+	open(...args) {
+		return promisify(fs.open)(...args);
+	},
+	getIoStats() {
+		return fs.getIoStats();
+	},
+	resetIoStats() {
+		fs.resetIoStats();
+	},
+	getQueueMetrics() {
+		return fs.getQueueMetrics();
+	},
+	resetQueueMetrics() {
+		fs.resetQueueMetrics();
+	},
+};
+
+parentPort.on('message', async ({ id, method, args }) => {
+	try {
+		const fn = methods[method] || fs.promises[method];
+		const result = await fn(...decode(args));
+		parentPort.postMessage({ id, result: encode(result) });
+	} catch (error) {
+		parentPort.postMessage({ id, error: encodeError(error) });
+	}
+});
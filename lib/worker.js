@@ -0,0 +1,376 @@
+'use strict';
+/*global SharedArrayBuffer*/
+
+const { join } = require('path');
+const { callbackify } = require('util');
+const { Worker } = require('worker_threads');
+
+const { DiskWrapper } = require('./disk');
+const { Dirent, Stats, fieldsFromStats, statsFromFields } = require('./fs');
+
+// Methods of the promises API that are forwarded to the worker as is, see
+// lib/worker-thread.js.
+const REMOTE_METHODS = [
+	'access', 'close', 'readFile', 'writeFile', 'appendFile', 'rename',
+	'truncate', 'ftruncate', 'rmdir', 'unlink', 'fdatasync', 'fsync', 'mkdir',
+	'mkdtemp', 'readdir', 'fstat', 'lstat', 'stat', 'readlink', 'symlink',
+	'link', 'fchmod', 'lchmod', 'chmod', 'lchown', 'fchown', 'chown', 'batch',
+];
+
+// Values cross the thread boundary with postMessage. Buffers are passed as
+// SharedArrayBuffer slices instead of structured-clone copies: a Buffer that
+// is already backed by shared memory is passed as is, others are copied once
+// into a new SharedArrayBuffer. `copies` collects the latter so that the
+// caller can copy the data back when the worker fills them.
+function encode(value, copies) {
+	if (value instanceof Uint8Array) {
+		if (value.buffer instanceof SharedArrayBuffer) {
+			return { $buffer: value.buffer, byteOffset: value.byteOffset, length: value.length };
+		}
+		const shared = Buffer.from(new SharedArrayBuffer(value.length));
+		Buffer.from(value.buffer, value.byteOffset, value.length).copy(shared);
+		if (copies !== undefined) {
+			copies.push([value, shared]);
+		}
+		return { $buffer: shared.buffer, byteOffset: 0, length: shared.length };
+	}
+	if (value instanceof Stats) {
+		return { $stats: fieldsFromStats(value) };
+	}
+	if (value instanceof Dirent) {
+		return { $dirent: [encode(value.name, copies), value._type, value.parentPath] };
+	}
+	if (value instanceof Error) {
+		return { $error: encodeError(value) };
+	}
+	if (Array.isArray(value)) {
+		return value.map((item) => encode(item, copies));
+	}
+	if (value !== null && typeof value === 'object' && value.constructor === Object) {
+		const result = {};
+		for (const [key, item] of Object.entries(value)) {
+			result[key] = encode(item, copies);
+		}
+		return result;
+	}
+	return value;
+}
+exports.encode = encode;
+
+function decode(value) {
+	if (Array.isArray(value)) {
+		return value.map(decode);
+	}
+	if (value !== null && typeof value === 'object') {
+		if (value.$buffer !== undefined) {
+			return Buffer.from(value.$buffer, value.byteOffset, value.length);
+		}
+		if (value.$stats !== undefined) {
+			return statsFromFields(value.$stats);
+		}
+		if (value.$dirent !== undefined) {
+			const [name, type, path] = value.$dirent;
+			return new Dirent(decode(name), type, path);
+		}
+		if (value.$error !== undefined) {
+			return decodeError(value.$error);
+		}
+		const result = {};
+		for (const [key, item] of Object.entries(value)) {
+			result[key] = decode(item);
+		}
+		return result;
+	}
+	return value;
+}
+exports.decode = decode;
+
+function encodeError(error) {
+	const { name, message, code, errno, syscall } = error;
+	return { name, message, code, errno, syscall };
+}
+exports.encodeError = encodeError;
+
+function decodeError(encoded) {
+	return Object.assign(new Error(encoded.message), encoded);
+}
+
+// Index of the fields of the control Int32Array shared with the worker.
+const CONTROL_DONE = 0;
+const CONTROL_STATUS = 1;
+exports.CONTROL_DONE = CONTROL_DONE;
+exports.CONTROL_STATUS = CONTROL_STATUS;
+
+// Runs a disk request posted by the worker, which waits on the control array
+// until it is done.
+async function serveDiskRequest(disk, control, request) {
+	const { op, offset, length, ranges, data } = request;
+	const buffer = length !== undefined && data !== undefined ? Buffer.from(data, 0, length) : undefined;
+	let status = 0;
+	try {
+		switch (op) {
+			case 'read':
+				await disk.read(buffer, 0, length, offset);
+				break;
+			case 'write':
+				await disk.write(buffer, 0, length, offset);
+				break;
+			case 'flush':
+				await disk.flush();
+				break;
+			case 'discard':
+				await disk.discard(offset, length);
+				break;
+			case 'discardMany':
+				await new DiskWrapper(disk).discardMany(ranges);
+				break;
+			case 'zeroOut':
+				await disk.zeroOut(offset, length);
+				break;
+			default:
+				throw new Error(`Unknown disk request ${op}`);
+		}
+	} catch (error) {
+		status = 1;
+	}
+	Atomics.store(control, CONTROL_STATUS, status);
+	Atomics.store(control, CONTROL_DONE, 1);
+	Atomics.notify(control, CONTROL_DONE);
+}
+
+class WorkerFileHandle {
+	constructor(promises, fd) {
+		this.promises = promises;
+		this.fd = fd;
+	}
+
+	close() {
+		return this.promises.close(this.fd);
+	}
+
+	appendFile(data, options) {
+		return this.promises.writeFile(this.fd, data, options);
+	}
+
+	chmod(mode) {
+		return this.promises.fchmod(this.fd, mode);
+	}
+
+	chown(uid, gid) {
+		return this.promises.fchown(this.fd, uid, gid);
+	}
+
+	datasync() {
+		return this.promises.fdatasync(this.fd);
+	}
+
+	sync() {
+		return this.promises.fsync(this.fd);
+	}
+
+	read(buffer, offset, length, position) {
+		return this.promises.read(this.fd, buffer, offset, length, position);
+	}
+
+	readFile(options) {
+		return this.promises.readFile(this.fd, options);
+	}
+
+	stat() {
+		return this.promises.fstat(this.fd);
+	}
+
+	truncate(len = 0) {
+		return this.promises.ftruncate(this.fd, len);
+	}
+
+	write(buffer, offset, length, position) {
+		return this.promises.write(this.fd, buffer, offset, length, position);
+	}
+
+	writeFile(data, options) {
+		return this.promises.writeFile(this.fd, data, options);
+	}
+}
+
+// fs returned by mountInWorker -> function unmounting it, kept out of the fs
+// object so that the worker can't be reached through it.
+const workerUmounts = new WeakMap();
+
+// Worker thread running lib/worker-thread.js. It holds one mount at a time,
+// `disk` is the disk of the current one. Pools (lib/pool.js) keep one per lane
+// and reuse it for every job of the lane.
+class MountWorker {
+	constructor() {
+		this.control = new Int32Array(new SharedArrayBuffer(8));
+		this.worker = new Worker(join(__dirname, 'worker-thread.js'), {
+			workerData: { control: this.control },
+		});
+		this.disk = undefined;
+		this.exited = false;
+		this.calls = new Map();
+		this.nextId = 0;
+		this.worker.on('message', (message) => {
+			if (message.disk !== undefined) {
+				serveDiskRequest(this.disk, this.control, message.disk);
+				return;
+			}
+			const { resolve, reject } = this.calls.get(message.id);
+			this.calls.delete(message.id);
+			if (message.error !== undefined) {
+				reject(decodeError(message.error));
+			} else {
+				resolve(decode(message.result));
+			}
+		});
+		this.worker.on('error', (error) => {
+			this.fail(error);
+		});
+		this.worker.on('exit', (code) => {
+			this.exited = true;
+			this.fail(new Error(`ext2fs worker exited with code ${code}`));
+		});
+	}
+
+	fail(error) {
+		for (const { reject } of this.calls.values()) {
+			reject(error);
+		}
+		this.calls.clear();
+	}
+
+	call(method, args, copies) {
+		return new Promise((resolve, reject) => {
+			if (this.exited) {
+				reject(new Error('ext2fs worker has exited'));
+				return;
+			}
+			const id = this.nextId++;
+			this.calls.set(id, { resolve, reject });
+			this.worker.postMessage({ id, method, args: encode(args, copies) });
+		});
+	}
+
+	// The thread only keeps the process alive while it holds a mount.
+	attach(disk) {
+		this.disk = disk;
+		this.worker.ref();
+	}
+
+	detach() {
+		this.disk = undefined;
+		this.worker.unref();
+	}
+
+	async terminate() {
+		await this.worker.terminate();
+	}
+}
+exports.MountWorker = MountWorker;
+
+// Mounts `disk` in a worker thread, `mountWorker` or a new one that is
+// terminated on umount. The returned object has the promises and callback
+// APIs of a regular mount, minus streams. libext2fs runs in the worker, and
+// its disk requests are sent back to this thread, which owns `disk`.
+async function mountInWorker(disk, offset, options, mountWorker) {
+	const owned = mountWorker === undefined;
+	if (owned) {
+		mountWorker = new MountWorker();
+	}
+	const release = async () => {
+		mountWorker.detach();
+		if (owned) {
+			await mountWorker.terminate();
+		}
+	};
+	// The worker may hold another mount once this one is unmounted.
+	let mounted = true;
+	const call = (method, args, copies) => {
+		if (!mounted) {
+			return Promise.reject(new Error('Filesystem is unmounted'));
+		}
+		return mountWorker.call(method, args, copies);
+	};
+
+	mountWorker.attach(disk);
+	try {
+		await call('mount', [offset, options, typeof disk.zeroOut === 'function']);
+	} catch (error) {
+		await release();
+		throw error;
+	}
+
+	const promises = {};
+	for (const method of REMOTE_METHODS) {
+		promises[method] = (...args) => call(method, args);
+	}
+	promises.open = async (path, flags, mode) => {
+		return new WorkerFileHandle(promises, await call('open', [path, flags, mode]));
+	};
+	promises.read = async (fd, buffer, offset, length, position) => {
+		const copies = [];
+		const { bytesRead } = await call('read', [fd, buffer, offset, length, position], copies);
+		for (const [original, shared] of copies) {
+			shared.copy(original);
+		}
+		return { bytesRead, buffer };
+	};
+	promises.trim = async (options = {}) => {
+		// Functions can't be passed to the worker.
+		if (options.onProgress !== undefined) {
+			throw new TypeError('"onProgress" option is not available for worker mounts');
+		}
+		return await call('trim', [options]);
+	};
+	promises.write = async (fd, buffer, ...args) => {
+		const result = await call('write', [fd, buffer, ...args]);
+		return { bytesWritten: result.bytesWritten, buffer };
+	};
+
+	const fs = { promises };
+	for (const method of REMOTE_METHODS) {
+		fs[method] = callbackify(promises[method]);
+	}
+	fs.open = callbackify((...args) => call('open', args));
+	// Promise based on both APIs, like on regular mounts.
+	fs.trim = promises.trim;
+	fs.read = (fd, buffer, offset, length, position, cb) => {
+		promises.read(fd, buffer, offset, length, position).then(({ bytesRead }) => {
+			cb(null, bytesRead, buffer);
+		}, cb);
+	};
+	fs.write = (fd, buffer, ...args) => {
+		const cb = args.pop();
+		promises.write(fd, buffer, ...args).then(({ bytesWritten }) => {
+			cb(null, bytesWritten, buffer);
+		}, cb);
+	};
+
+	// The last io stats are kept so that they are still available once the
+	// worker is gone.
+	let ioStats;
+	fs.getIoStats = promises.getIoStats = async () => {
+		return ioStats !== undefined ? ioStats : await call('getIoStats', []);
+	};
+	fs.resetIoStats = promises.resetIoStats = () => call('resetIoStats', []);
+	fs.getQueueMetrics = promises.getQueueMetrics = () => call('getQueueMetrics', []);
+	fs.resetQueueMetrics = promises.resetQueueMetrics = () => call('resetQueueMetrics', []);
+	workerUmounts.set(fs, async () => {
+		try {
+			ioStats = await call('umount', []);
+		} finally {
+			mounted = false;
+			await release();
+		}
+		return ioStats;
+	});
+	return fs;
+}
+exports.mountInWorker = mountInWorker;
+
+// Returns the function unmounting `fs` and stopping its worker if `fs` comes
+// from mountInWorker, undefined otherwise.
+function getWorkerUmount(fs) {
+	return workerUmounts.get(fs);
+}
+exports.getWorkerUmount = getWorkerUmount;
@@ -0,0 +1,182 @@
+'use strict';
+
+// Derives the ASYNCIFY_ONLY list of the tuned build from the call graph of a
+// probe build, instead of letting Asyncify instrument every function that
+// may reach an async import through any indirect call.
+//
+//   node scripts/asyncify-only.js list <probe.wasm> <advise.txt> <out.json> <wasm-dis> <import>...
+//   node scripts/asyncify-only.js report <before.wasm> <after.wasm>
+//   node scripts/asyncify-only.js exports <asyncify-only.json> <exports.js> <export>...
+//
+// The probe is the regular Asyncify build linked with --profiling-funcs (so
+// that functions keep their names), -s ASYNCIFY_ADVISE, whose output is
+// `advise.txt`, and -O0. Optimizing after the Asyncify pass would inline
+// functions that the other builds still have, and a function missing from
+// the probe would silently be left out of the list. Indirect calls are
+// resolved by signature against the functions of the table: a call_indirect
+// can only reach the functions of the table that have its type. Binaryen assumes any of them can suspend, so
+// the bitmap operations, qsort callbacks and checksum helpers, which are only
+// called through function pointers, end up instrumented.
+//
+// `exports` checks the split of lib/exports.js against the list: an export
+// that may suspend, because it is in the list, must be in ASYNC_EXPORTS.
+// The arena of lib/util.js calls the SYNC_EXPORTS outside of the operation
+// queue, and the JSPI build only wraps the ASYNC_EXPORTS. ASYNC_EXPORTS may
+// hold exports that never suspend, they are only reported.
+
+const { execFileSync } = require('child_process');
+const { readFileSync, statSync, writeFileSync } = require('fs');
+const { resolve } = require('path');
+
+const NAME = '\\$[^\\s()]+';
+
+function parseModule(text) {
+	const types = new Map();  // type name -> signature
+	const functionTypes = new Map();  // function name -> signature
+	const calls = new Map();  // function name -> Set of callees
+	const indirectCalls = new Map();  // function name -> Set of signatures
+	const table = new Set();
+	let current;
+	for (const line of text.split('\n')) {
+		let match;
+		if ((match = line.match(new RegExp(`^ \\(type (${NAME}) \\(func(.*)\\)\\)\\s*$`)))) {
+			types.set(match[1], match[2].trim());
+		} else if ((match = line.match(new RegExp(`^ \\(import "[^"]*" "[^"]*" \\(func (${NAME}) \\(type (${NAME})\\)`)))) {
+			functionTypes.set(match[1], types.get(match[2]));
+			current = undefined;
+		} else if ((match = line.match(new RegExp(`^ \\(func (${NAME}) \\(type (${NAME})\\)`)))) {
+			current = match[1];
+			functionTypes.set(current, types.get(match[2]));
+			calls.set(current, new Set());
+			indirectCalls.set(current, new Set());
+		} else if (line.startsWith(' (elem ')) {
+			for (const name of line.match(new RegExp(NAME, 'g')).slice(1)) {
+				table.add(name);
+			}
+			current = undefined;
+		} else if (current !== undefined) {
+			for (const callee of line.matchAll(new RegExp(`\\((?:return_)?call (${NAME})`, 'g'))) {
+				calls.get(current).add(callee[1]);
+			}
+			for (const call of line.matchAll(new RegExp(`\\((?:return_)?call_indirect (?:${NAME} )?\\(type (${NAME})\\)`, 'g'))) {
+				indirectCalls.get(current).add(types.get(call[1]));
+			}
+		}
+	}
+	return { functionTypes, calls, indirectCalls, table };
+}
+
+// Functions that can reach one of `roots`, the roots excluded.
+function reachingFunctions({ functionTypes, calls, indirectCalls, table }, roots) {
+	const callers = new Map();
+	const addEdge = (caller, callee) => {
+		if (!callers.has(callee)) {
+			callers.set(callee, new Set());
+		}
+		callers.get(callee).add(caller);
+	};
+	const tableBySignature = new Map();
+	for (const name of table) {
+		const signature = functionTypes.get(name);
+		if (!tableBySignature.has(signature)) {
+			tableBySignature.set(signature, []);
+		}
+		tableBySignature.get(signature).push(name);
+	}
+	for (const [caller, callees] of calls) {
+		for (const callee of callees) {
+			addEdge(caller, callee);
+		}
+		for (const signature of indirectCalls.get(caller)) {
+			for (const callee of tableBySignature.get(signature) || []) {
+				addEdge(caller, callee);
+			}
+		}
+	}
+	const result = new Set();
+	const pending = [...roots];
+	while (pending.length > 0) {
+		for (const caller of callers.get(pending.pop()) || []) {
+			if (!result.has(caller) && !roots.includes(caller)) {
+				result.add(caller);
+				pending.push(caller);
+			}
+		}
+	}
+	return result;
+}
+
+function parseAdvise(text) {
+	const result = new Set();
+	for (const match of text.matchAll(/^\[asyncify\] (\S+) can change the state/gm)) {
+		result.add(match[1]);
+	}
+	return result;
+}
+
+function list(probe, advisePath, out, wasmDis, imports) {
+	const module = parseModule(execFileSync(wasmDis, [probe], { encoding: 'utf8', maxBuffer: 1024 ** 3 }));
+	const roots = imports.map((name) => `$${name}`);
+	for (const root of roots) {
+		if (!module.functionTypes.has(root)) {
+			throw new Error(`Async import ${root} not found in ${probe}`);
+		}
+	}
+	const reaching = reachingFunctions(module, roots);
+	const advise = parseAdvise(readFileSync(advisePath, 'utf8'));
+	if (advise.size === 0) {
+		throw new Error(`No instrumented function found in ${advisePath}`);
+	}
+	const missing = [...advise].filter((name) => !module.functionTypes.has(`$${name}`));
+	if (missing.length > 0) {
+		throw new Error(`Instrumented by Asyncify but not found in ${probe}, was it optimized? ${missing.join(', ')}`);
+	}
+	const names = [...reaching].map((name) => name.slice(1)).sort();
+	// Our analysis only removes edges from Binaryen's, so it must not find a
+	// function that Binaryen does not instrument.
+	const unexpected = names.filter((name) => !advise.has(name));
+	if (unexpected.length > 0) {
+		throw new Error(`Not instrumented by Asyncify: ${unexpected.join(', ')}`);
+	}
+	writeFileSync(out, JSON.stringify(names, null, '\t') + '\n');
+	console.log(`asyncify-only: ${names.length} functions instrumented instead of ${advise.size}`);
+}
+
+function report(before, after) {
+	const beforeSize = statSync(before).size;
+	const afterSize = statSync(after).size;
+	const change = ((afterSize - beforeSize) / beforeSize * 100).toFixed(1);
+	console.log(`asyncify-only: ${before} ${beforeSize} bytes, ${after} ${afterSize} bytes (${change}%)`);
+}
+
+function checkExports(listPath, exportsPath, names) {
+	const reaching = new Set(JSON.parse(readFileSync(listPath, 'utf8')));
+	const { ASYNC_EXPORTS, SYNC_EXPORTS } = require(resolve(exportsPath));
+	const unlisted = names.filter((name) => !ASYNC_EXPORTS.has(name) && !SYNC_EXPORTS.has(name));
+	if (unlisted.length > 0) {
+		throw new Error(`Exports missing from ${exportsPath}: ${unlisted.join(', ')}`);
+	}
+	const suspending = names.filter((name) => reaching.has(name) && !ASYNC_EXPORTS.has(name));
+	if (suspending.length > 0) {
+		throw new Error(`Exports that may suspend but are not in ASYNC_EXPORTS: ${suspending.join(', ')}`);
+	}
+	const neverSuspending = names.filter((name) => !reaching.has(name) && ASYNC_EXPORTS.has(name));
+	if (neverSuspending.length > 0) {
+		console.log(`asyncify-only: never suspend but are in ASYNC_EXPORTS: ${neverSuspending.join(', ')}`);
+	}
+	console.log(`asyncify-only: ${exportsPath} is consistent with the call graph`);
+}
+
+const [command, ...args] = process.argv.slice(2);
+if (command === 'list') {
+	const [probe, advise, out, wasmDis, ...imports] = args;
+	list(probe, advise, out, wasmDis, imports);
+} else if (command === 'report') {
+	report(...args);
+} else if (command === 'exports') {
+	const [listPath, exportsPath, ...names] = args;
+	checkExports(listPath, exportsPath, names);
+} else {
+	console.error('usage: asyncify-only.js list|report|exports ...');
+	process.exit(1);
+}
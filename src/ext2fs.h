@@ -231,6 +231,7 @@ typedef __u64 ext2_off64_t;
 #define EXT2_FT_REG_FILE 1
 
 #define EXT4_INLINE_DATA_FL    0x10000000 /* Inode has inline data */
+#define EXT4_HUGE_FILE_FL   0x00040000 /* Set to each huge file */
 #define EXT4_EXTENTS_FL     0x00080000 /* Inode uses extents */
 
 #define EXT2_SB(sb)  (sb)
@@ -274,7 +275,13 @@ typedef __u64 ext2_off64_t;
 #define LINUX_S_ISFIFO(m)  (((m) & LINUX_S_IFMT) == LINUX_S_IFIFO)
 #define LINUX_S_ISSOCK(m)  (((m) & LINUX_S_IFMT) == LINUX_S_IFSOCK)
 
-typedef void* io_stats;
+typedef struct struct_io_stats *io_stats;
+struct struct_io_stats {
+	int			num_fields;
+	int			reserved;
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_written;
+};
 typedef void* ext2fs_inode_bitmap;
 typedef void* ext2fs_block_bitmap;
 
@@ -298,6 +305,23 @@ errcode_t ext2fs_namei_follow(
   ext2_ino_t *inode
 );
 
+errcode_t ext2fs_follow_link(
+  ext2_filsys fs,
+  ext2_ino_t root,
+  ext2_ino_t cwd,
+  ext2_ino_t inode,
+  ext2_ino_t *res_inode
+);
+
+errcode_t ext2fs_lookup(
+  ext2_filsys fs,
+  ext2_ino_t dir,
+  const char *name,
+  int namelen,
+  char *buf,
+  ext2_ino_t *inode
+);
+
 #define EXT2_ET_NO_MEMORY (2133571398L)
 
 extern errcode_t ext2fs_get_mem(unsigned long size, void *ptr);
@@ -419,6 +443,7 @@ struct ext2_dir_entry {
 };
 
 extern int ext2fs_dirent_name_len(const struct ext2_dir_entry *entry);
+extern int ext2fs_dirent_file_type(const struct ext2_dir_entry *entry);
 
 struct ext2_file {
   errcode_t magic;
@@ -743,6 +768,8 @@ struct struct_io_channel {
   int    align;
 };
 
+#define IO_FLAG_RW 0x0001
+
 struct struct_io_manager {
   errcode_t magic;
   const char *name;
@@ -764,15 +791,51 @@ struct struct_io_manager {
 };
 
 errcode_t ext2fs_open(const char *name, int flags, int superblock, unsigned int block_size, io_manager manager, ext2_filsys *ret_fs);
+errcode_t ext2fs_open2(const char *name, const char *io_options, int flags, int superblock, unsigned int block_size, io_manager manager, ext2_filsys *ret_fs);
 errcode_t ext2fs_close(ext2_filsys fs);
+void ext2fs_free(ext2_filsys fs);
 extern errcode_t ext2fs_flush(ext2_filsys fs);
 extern errcode_t ext2fs_flush2(ext2_filsys fs, int flags);
 extern errcode_t ext2fs_close_free(ext2_filsys *fs);
 
 errcode_t ext2fs_read_block_bitmap(ext2_filsys fs);
 
+blk64_t ext2fs_blocks_count(struct ext2_super_block *super);
+blk64_t ext2fs_block_bitmap_loc(ext2_filsys fs, dgrp_t group);
+blk64_t ext2fs_inode_bitmap_loc(ext2_filsys fs, dgrp_t group);
+blk64_t ext2fs_inode_table_loc(ext2_filsys fs, dgrp_t group);
+errcode_t ext2fs_super_and_bgd_loc2(
+  ext2_filsys fs,
+  dgrp_t group,
+  blk64_t *ret_super_blk,
+  blk64_t *ret_old_desc_blk,
+  blk64_t *ret_new_desc_blk,
+  blk_t *ret_used_blks
+);
+
 int ext2fs_test_block_bitmap(ext2fs_block_bitmap bitmap, blk_t block);
 
+typedef void* ext2fs_generic_bitmap;
+
+extern errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap, __u64 start, __u64 end, __u64 *out);
+extern errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap, __u64 start, __u64 end, __u64 *out);
+
+static inline errcode_t ext2fs_find_first_zero_block_bitmap2(ext2fs_block_bitmap bitmap, blk64_t start, blk64_t end, blk64_t *out) {
+  __u64 o;
+  errcode_t rv = ext2fs_find_first_zero_generic_bmap((ext2fs_generic_bitmap) bitmap, start, end, &o);
+  if (!rv)
+    *out = o;
+  return rv;
+}
+
+static inline errcode_t ext2fs_find_first_set_block_bitmap2(ext2fs_block_bitmap bitmap, blk64_t start, blk64_t end, blk64_t *out) {
+  __u64 o;
+  errcode_t rv = ext2fs_find_first_set_generic_bmap((ext2fs_generic_bitmap) bitmap, start, end, &o);
+  if (!rv)
+    *out = o;
+  return rv;
+}
+
 /*extern errcode_t ext2fs_file_open(ext2_filsys fs, ino_t ino, int flags, ext2_file_t *ret);*/
 
 errcode_t io_channel_discard(io_channel channel, unsigned long long block, unsigned long long count);
@@ -1,5 +1,6 @@
 #include <emscripten.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -99,10 +100,9 @@ EM_JS(void, array_push_buffer, (int array_id, char* value, int len), {
 	Module.getObject(array_id).push(buffer);
 });
 
-EM_ASYNC_JS(errcode_t, blk_read, (int disk_id, short block_size, unsigned long block, unsigned long count, void *data), {
-	const offset = block * block_size;
-	const size = count < 0 ? -count : count * block_size;
-	const buffer = Module.getBuffer(data, size);
+// Offsets are doubles so that they are exact up to 2^53 bytes on the js side.
+EM_ASYNC_JS(errcode_t, blk_read, (int disk_id, double offset, unsigned int length, void *data), {
+	const buffer = Module.getBuffer(data, length);
 	const disk = Module.getObject(disk_id);
 	try {
 		await disk.read(buffer, 0, buffer.length, offset);
@@ -112,10 +112,8 @@ EM_ASYNC_JS(errcode_t, blk_read, (int disk_id, short block_size, unsigned long b
 	}
 });
 
-EM_ASYNC_JS(errcode_t, blk_write, (int disk_id, short block_size, unsigned long block, unsigned long count, const void *data), {
-	const offset = block * block_size;
-	const size = count < 0 ? -count : count * block_size;
-	const buffer = Module.getBuffer(data, size);
+EM_ASYNC_JS(errcode_t, blk_write, (int disk_id, double offset, unsigned int length, const void *data), {
+	const buffer = Module.getBuffer(data, length);
 	const disk = Module.getObject(disk_id);
 	try {
 		await disk.write(buffer, 0, buffer.length, offset);
@@ -125,18 +123,141 @@ EM_ASYNC_JS(errcode_t, blk_write, (int disk_id, short block_size, unsigned long
 	}
 });
 
-EM_ASYNC_JS(errcode_t, discard, (int disk_id, short block_size, unsigned long block, unsigned long count), {
+// Synchronous variants for disks that implement readSync / writeSync /
+// flushSync, see DISK_CAP_*. They are plain imports: calling them does not
+// unwind the stack.
+EM_JS(errcode_t, blk_read_sync, (int disk_id, double offset, unsigned int length, void *data), {
+	const buffer = Module.getBuffer(data, length);
 	const disk = Module.getObject(disk_id);
-	const offset = block * block_size;
-	const size = count < 0 ? -count : count * block_size;
 	try {
-		await disk.discard(offset, size);
+		disk.readSync(buffer, 0, buffer.length, offset);
 		return 0;
 	} catch (error) {
 		return Module.EIO;
 	}
 });
 
+EM_JS(errcode_t, blk_write_sync, (int disk_id, double offset, unsigned int length, const void *data), {
+	const buffer = Module.getBuffer(data, length);
+	const disk = Module.getObject(disk_id);
+	try {
+		disk.writeSync(buffer, 0, buffer.length, offset);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+// A contiguous run of blocks for blk_writev, offsets are doubles so they are
+// exact up to 2^53 bytes on the js side.
+struct js_write_segment {
+	double offset;
+	unsigned int length;
+	const char *buf;
+};
+
+EM_ASYNC_JS(errcode_t, blk_writev, (int disk_id, const struct js_write_segment *segments, int count), {
+	const disk = Module.getObject(disk_id);
+	const chunks = [];
+	for (let i = 0; i < count; i++) {
+		const segment = segments + i * 16;
+		const length = Module.HEAPU32[(segment + 8) >> 2];
+		const buf = Module.HEAPU32[(segment + 12) >> 2];
+		chunks.push({
+			buffer: Module.getBuffer(buf, length),
+			offset: Module.HEAPF64[segment >> 3],
+		});
+	}
+	try {
+		await disk.writev(chunks);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+EM_JS(errcode_t, blk_writev_sync, (int disk_id, const struct js_write_segment *segments, int count), {
+	const disk = Module.getObject(disk_id);
+	const chunks = [];
+	for (let i = 0; i < count; i++) {
+		const segment = segments + i * 16;
+		const length = Module.HEAPU32[(segment + 8) >> 2];
+		const buf = Module.HEAPU32[(segment + 12) >> 2];
+		chunks.push({
+			buffer: Module.getBuffer(buf, length),
+			offset: Module.HEAPF64[segment >> 3],
+		});
+	}
+	try {
+		disk.writevSync(chunks);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+EM_ASYNC_JS(errcode_t, discard, (int disk_id, double offset, double length), {
+	const disk = Module.getObject(disk_id);
+	try {
+		await disk.discard(offset, length);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+// A byte range for discard_ranges, laid out as two doubles so js can read the
+// whole array through HEAPF64.
+struct js_discard_range {
+	double offset;
+	double length;
+};
+
+#define DISCARD_BATCH	4096
+
+// Ranges queued by trim, see js_discard_batch_add.
+struct js_discard_batch {
+	io_channel channel;
+	int count;
+	double discarded;	// in bytes, after granularity alignment
+	struct js_discard_range ranges[DISCARD_BATCH];
+};
+
+EM_ASYNC_JS(errcode_t, discard_ranges, (int disk_id, const struct js_discard_range *ranges, int count), {
+	const disk = Module.getObject(disk_id);
+	const list = [];
+	for (let i = 0; i < count; i++) {
+		const range = (ranges >> 3) + i * 2;
+		list.push({ offset: Module.HEAPF64[range], length: Module.HEAPF64[range + 1] });
+	}
+	try {
+		await disk.discardMany(list);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+EM_ASYNC_JS(errcode_t, zero_out, (int disk_id, double offset, double length), {
+	const disk = Module.getObject(disk_id);
+	try {
+		await disk.zeroOut(offset, length);
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
+// Optional disk methods, see DiskWrapper.capabilities in lib/disk.js
+#define DISK_CAP_ZEROOUT	0x0001
+#define DISK_CAP_READSYNC	0x0002
+#define DISK_CAP_WRITESYNC	0x0004
+#define DISK_CAP_FLUSHSYNC	0x0008
+
+EM_JS(int, disk_capabilities, (int disk_id), {
+	return Module.getObject(disk_id).capabilities();
+});
+
 EM_ASYNC_JS(errcode_t, flush, (int disk_id), {
 	const disk = Module.getObject(disk_id);
 	try {
@@ -147,36 +268,160 @@ EM_ASYNC_JS(errcode_t, flush, (int disk_id), {
 	}
 });
 
+// Lets the event loop run during long operations, after calling the progress
+// callback `callback_id` (0 for none). A callback that throws cancels the
+// operation.
+EM_ASYNC_JS(errcode_t, yield_to_js, (int callback_id, double done, double max), {
+	if (callback_id !== 0) {
+		try {
+			Module.getObject(callback_id)(done, max);
+		} catch (error) {
+			return Module.ECANCELED;
+		}
+	}
+	await new Promise((resolve) => setImmediate(resolve));
+	return 0;
+});
+
+EM_JS(errcode_t, report_progress, (int callback_id, double done, double max), {
+	try {
+		Module.getObject(callback_id)(done, max);
+		return 0;
+	} catch (error) {
+		return Module.ECANCELED;
+	}
+});
+
+EM_JS(errcode_t, flush_sync, (int disk_id), {
+	const disk = Module.getObject(disk_id);
+	try {
+		disk.flushSync();
+		return 0;
+	} catch (error) {
+		return Module.EIO;
+	}
+});
+
 // Utils ------------------
+// Looks `name` up in `dir` through the dentry cache, see js_dcache_lookup.
+static errcode_t lookup_entry(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino, int *is_link) {
+	struct ext2_inode inode;
+	errcode_t ret;
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+		// Not cached: ".." changes when the directory is moved.
+		*is_link = 0;
+		return ext2fs_lookup(fs, dir, name, len, NULL, ino);
+	}
+	if (js_dcache_lookup(fs, dir, name, len, ino, is_link)) {
+		return *ino ? 0 : EXT2_ET_FILE_NOT_FOUND;
+	}
+	ret = ext2fs_lookup(fs, dir, name, len, NULL, ino);
+	if (ret == EXT2_ET_FILE_NOT_FOUND) {
+		js_dcache_insert(fs, dir, name, len, 0, 0);
+	}
+	if (ret) return ret;
+	ret = ext2fs_read_inode(fs, *ino, &inode);
+	if (ret) return ret;
+	*is_link = LINUX_S_ISLNK(inode.i_mode);
+	js_dcache_insert(fs, dir, name, len, *ino, *is_link);
+	return 0;
+}
+
+// Same as ext2fs_namei (or ext2fs_namei_follow when `follow` is set) from the
+// root directory, one component at a time so that the lookups are cached.
+static errcode_t lookup_path(ext2_filsys fs, const char *path, int follow, ext2_ino_t *ino) {
+	ext2_ino_t dir = EXT2_ROOT_INO;
+	const char *name = path;
+	const char *end;
+	int is_link;
+	errcode_t ret;
+	*ino = EXT2_ROOT_INO;
+	while (*name == '/') name++;
+	while (*name) {
+		for (end = name; *end && *end != '/'; end++);
+		ret = lookup_entry(fs, dir, name, end - name, ino, &is_link);
+		if (ret) return ret;
+		// Like namei, links are followed for every component but the
+		// last one, and for that one too when there's a trailing slash.
+		if (is_link && (*end || follow)) {
+			ret = ext2fs_follow_link(fs, EXT2_ROOT_INO, dir, *ino, ino);
+			if (ret) return ret;
+		}
+		dir = *ino;
+		for (name = end; *name == '/'; name++);
+	}
+	return 0;
+}
+
 ext2_ino_t string_to_inode(ext2_filsys fs, const char *str, int follow) {
 	ext2_ino_t ino;
-	int retval;
-	if (follow) {
-		retval = ext2fs_namei_follow(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, str, &ino);
-	} else {
-		retval = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, str, &ino);
-	}
-	if (retval) {
+	if (lookup_path(fs, str, follow, &ino)) {
 		return 0;
 	}
 	return ino;
 }
 
+struct readdir_context {
+	ext2_filsys fs;
+	char *records;	// struct node_ext2fs_dirent records
+	size_t length;
+	size_t size;
+	struct js_progress progress;	// counts entries, yields in large directories
+	errcode_t ret;
+};
+
+static errcode_t push_dirent(struct readdir_context *ctx, struct ext2_dir_entry *dirent, size_t len) {
+	struct node_ext2fs_dirent record;
+	struct ext2_inode inode;
+	size_t needed = ctx->length + sizeof(record) + len;
+	errcode_t ret;
+	if (needed > ctx->size) {
+		size_t size = ctx->size ? ctx->size : ctx->fs->blocksize;
+		while (size < needed) {
+			size *= 2;
+		}
+		char *records = realloc(ctx->records, size);
+		if (records == NULL) {
+			return EXT2_ET_NO_MEMORY;
+		}
+		ctx->records = records;
+		ctx->size = size;
+	}
+	record.ino = dirent->inode;
+	record.name_len = len;
+	record.file_type = EXT2_FT_UNKNOWN;
+	if (ext2fs_has_feature_filetype(ctx->fs->super)) {
+		record.file_type = ext2fs_dirent_file_type(dirent);
+	}
+	if (record.file_type == EXT2_FT_UNKNOWN) {
+		ret = js_icache_read(ctx->fs, dirent->inode, &inode, sizeof(inode));
+		if (ret) return ret;
+		record.file_type = ext2_file_type(inode.i_mode);
+	}
+	memcpy(ctx->records + ctx->length, &record, sizeof(record));
+	memcpy(ctx->records + ctx->length + sizeof(record), dirent->name, len);
+	ctx->length = needed;
+	return 0;
+}
+
 int copy_filename_to_result(
 	struct ext2_dir_entry *dirent,
 	int offset,
 	int blocksize,
 	char *buf,
-	void *priv_data	// this is the js array_id
+	void *priv_data	// struct readdir_context
 ) {
+	struct readdir_context *ctx = priv_data;
 	size_t len = ext2fs_dirent_name_len(dirent);
 	if (
 		(strncmp(dirent->name, ".", len) != 0) &&
 		(strncmp(dirent->name, "..", len) != 0)
 	) {
-		array_push_buffer((int)priv_data, dirent->name, len);
+		ctx->ret = push_dirent(ctx, dirent, len);
+		if (ctx->ret) return DIRENT_ABORT;
 	}
-	return 0;
+	ctx->ret = js_progress_update(&ctx->progress, ctx->progress.done + 1);
+	return ctx->ret ? DIRENT_ABORT : 0;
 }
 
 ext2_ino_t get_parent_dir_ino(ext2_filsys fs, const char* path) {
@@ -218,12 +463,16 @@ errcode_t create_file(ext2_filsys fs, const char* path, unsigned int mode, ext2_
 		// This should never happen.
 		return EISDIR;
 	}
+	// Expanding the directory writes its inode.
+	ret = js_icache_flush(fs, parent_ino);
+	if (ret) return ret;
 	ret = ext2fs_link(fs, parent_ino, filename, *ino, EXT2_FT_REG_FILE);
 	if (ret == EXT2_ET_DIR_NO_SPACE) {
 		ret = ext2fs_expand_dir(fs, parent_ino);
 		if (ret) return ret;
 		ret = ext2fs_link(fs, parent_ino, filename, *ino, EXT2_FT_REG_FILE);
 	}
+	js_dcache_invalidate(fs, parent_ino, filename, strlen(filename));
 	if (ret) return ret;
 	if (ext2fs_test_inode_bitmap2(fs->inode_map, *ino)) {
 		printf("Warning: inode already set\n");
@@ -253,34 +502,58 @@ errcode_t create_file(ext2_filsys fs, const char* path, unsigned int mode, ext2_
 	}
 	return 0;
 }
-static void get_now(struct timespec *now) {
-#ifdef CLOCK_REALTIME
-	if (!clock_gettime(CLOCK_REALTIME, now))
-		return;
-#endif
+// Reads file->inode, the copy libext2fs uses for an open file, through the
+// inode cache before it is used or modified.
+static errcode_t load_file_inode(ext2_file_t file) {
+	return js_icache_read(file->fs, file->ino, &(file->inode), sizeof(file->inode));
+}
 
-	now->tv_sec = time(NULL);
-	now->tv_nsec = 0;
+// Wall clock time in milliseconds, with a fraction. CLOCK_REALTIME comes from
+// Date.now() in emscripten, whole milliseconds only, which would leave the
+// nanosecond part of inode times at a multiple of 1000000.
+EM_JS(double, precise_date_now, (), {
+	return performance.timeOrigin + performance.now();
+});
+
+static void get_now(struct timespec *now) {
+	double ms = precise_date_now();
+	now->tv_sec = (time_t)(ms / 1000);
+	now->tv_nsec = (long)((ms - (double)now->tv_sec * 1000) * 1000000);
+	if (now->tv_nsec > 999999999) {
+		now->tv_nsec = 999999999;
+	} else if (now->tv_nsec < 0) {
+		now->tv_nsec = 0;
+	}
 }
 
 errcode_t update_xtime(ext2_file_t file, bool a, bool c, bool m) {
-	errcode_t err = 0;
-	err = ext2fs_read_inode(file->fs, file->ino, &(file->inode));
-	if (err) return err;
+	struct ext2_inode_large inode;
 	struct timespec now;
+	errcode_t err;
+	memset(&inode, 0, sizeof(inode));
+	err = js_icache_read(file->fs, file->ino, (struct ext2_inode *)&inode, sizeof(inode));
+	if (err) return err;
 	get_now(&now);
 	if (a) {
-		file->inode.i_atime = now.tv_sec;
+		EXT4_INODE_SET_XTIME(i_atime, &now, &inode);
 	}
 	if (c) {
-		file->inode.i_ctime = now.tv_sec;
+		EXT4_INODE_SET_XTIME(i_ctime, &now, &inode);
 	}
 	if (m) {
-		file->inode.i_mtime = now.tv_sec;
+		EXT4_INODE_SET_XTIME(i_mtime, &now, &inode);
 	}
-	increment_version(&(file->inode));
-	err = ext2fs_write_inode(file->fs, file->ino, &(file->inode));
-	return err;
+	increment_version((struct ext2_inode *)&inode);
+	err = js_icache_write(file->fs, file->ino, (struct ext2_inode *)&inode, sizeof(inode));
+	if (err) return err;
+	memcpy(&(file->inode), &inode, sizeof(file->inode));
+	return 0;
+}
+
+// Filesystems mounted with readOnly: every mutation fails with EROFS and
+// reads don't update atime.
+static bool is_read_only(ext2_filsys fs) {
+	return !(fs->flags & EXT2_FLAG_RW);
 }
 
 double getUInt64Number(unsigned long long hi, unsigned long long lo) {
@@ -300,13 +573,15 @@ void free_from_js(char *data) {
 	free(data);
 }
 
-errcode_t node_ext2fs_mount(int disk_id) {
+errcode_t node_ext2fs_mount(int disk_id, const char *io_options, int read_only, int progress_id) {
+	struct js_progress progress;
 	ext2_filsys fs;
 	char hex_ptr[sizeof(void*) * 2 + 3];
 	sprintf(hex_ptr, "%d", disk_id);
-	errcode_t ret = ext2fs_open(
+	errcode_t ret = ext2fs_open2(
 		hex_ptr,							// name
-		EXT2_FLAG_RW,				 // flags
+		io_options,						// io_options, see js_set_option_entry
+		read_only ? 0 : EXT2_FLAG_RW,	// flags
 		0,										// superblock
 		0,										// block_size
 		get_js_io_manager(),	// manager
@@ -315,52 +590,120 @@ errcode_t node_ext2fs_mount(int disk_id) {
 	if (ret) {
 		return -ret;
 	}
+	ret = js_load_metadata_map(fs);
+	if (ret) {
+		ext2fs_free(fs);
+		return -ret;
+	}
+	// Progress is counted in bitmap blocks read, one block bitmap and one
+	// inode bitmap per group (uninitialized ones are skipped).
+	js_progress_init(&progress, fs, progress_id, 2.0 * fs->group_desc_count);
+	js_set_channel_progress(fs->io, &progress);
 	ret = ext2fs_read_bitmaps(fs);
+	js_set_channel_progress(fs->io, NULL);
+	if (!ret) {
+		ret = js_progress_close(&progress);
+	}
 	if (ret) {
+		ext2fs_free(fs);
 		return -ret;
 	}
 	return (long)fs;
 }
 
-errcode_t node_ext2fs_trim(ext2_filsys fs) {
-	unsigned int start, blk, count;
+// Discards the free block runs of at least minlen bytes within
+// [start, start + len), like the FITRIM ioctl. Arguments are doubles so that
+// 64-bit byte offsets survive ccall. Returns the number of bytes discarded.
+double node_ext2fs_trim(ext2_filsys fs, double start, double len, double minlen, int progress_id) {
+	struct js_progress progress;
+	blk64_t first, last, blk, free_start, free_end, minblocks;
+	struct js_discard_batch *batch;
+	double fs_size, end, trimmed;
 	errcode_t ret;
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
 	if (!fs->block_map) {
 		if ((ret = ext2fs_read_block_bitmap(fs))) {
 			return -ret;
 		}
 	}
-	start = fs->super->s_first_data_block;
-	count = fs->super->s_blocks_count;
-	for (blk = start; blk <= count; blk++) {
-		// Check for either the last iteration or a used block
-		if (blk == count || ext2fs_test_block_bitmap(fs->block_map, blk)) {
-			if (start < blk) {
-				if ((ret = io_channel_discard(fs->io, start, blk - start))) {
-					return -ret;
-				}
-			}
-			start = blk + 1;
+	fs_size = (double)ext2fs_blocks_count(fs->super) * fs->blocksize;
+	end = start + len;
+	if (end > fs_size) {
+		end = fs_size;
+	}
+	if (start < 0 || start >= end) {
+		return 0;
+	}
+	first = start / fs->blocksize;
+	if (first < fs->super->s_first_data_block) {
+		first = fs->super->s_first_data_block;
+	}
+	last = (blk64_t)(end / fs->blocksize);
+	if (last <= first) {
+		return 0;
+	}
+	last--;
+	minblocks = (blk64_t)((minlen + fs->blocksize - 1) / fs->blocksize);
+	if (minblocks == 0) {
+		minblocks = 1;
+	}
+	// Free runs are queued and sent to the disk in as few discard_ranges
+	// calls as possible.
+	batch = malloc(sizeof(*batch));
+	if (batch == NULL) {
+		return -EXT2_ET_NO_MEMORY;
+	}
+	batch->channel = fs->io;
+	batch->count = 0;
+	batch->discarded = 0;
+	// Progress is counted in blocks scanned.
+	js_progress_init(&progress, fs, progress_id, last - first + 1);
+	for (blk = first; blk <= last; blk = free_end + 1) {
+		if ((ret = js_progress_update(&progress, blk - first))) {
+			goto out;
+		}
+		ret = ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk, last, &free_start);
+		if (ret == ENOENT) break;
+		if (ret) goto out;
+		ret = ext2fs_find_first_set_block_bitmap2(fs->block_map, free_start, last, &free_end);
+		if (ret == ENOENT) {
+			free_end = last + 1;
+		} else if (ret) {
+			goto out;
+		}
+		if (free_end - free_start < minblocks) continue;
+		if ((ret = js_discard_batch_add(batch, free_start, free_end - free_start))) {
+			goto out;
 		}
 	}
-	return 0;
+	ret = js_discard_batch_submit(batch);
+	if (!ret) {
+		ret = js_progress_close(&progress);
+	}
+out:
+	trimmed = batch->discarded;
+	free(batch);
+	if (ret) {
+		return -ret;
+	}
+	return trimmed;
 }
 
+// Pushes a single buffer of struct node_ext2fs_dirent records, one per entry
+// of the directory `path`, to the js array `array_id`.
 errcode_t node_ext2fs_readdir(ext2_filsys fs, char* path, int array_id) {
 	ext2_ino_t ino = string_to_inode(fs, path, 1);
 	if (ino == 0) {
 		return -ENOENT;
 	}
-	ext2_file_t file;
-	errcode_t ret = ext2fs_file_open(
-		fs,
-		ino, // inode,
-		0, // flags TODO
-		&file
-	);
-	if (ret) return -ret;
-	ret = ext2fs_check_directory(fs, ino);
+	errcode_t ret = ext2fs_check_directory(fs, ino);
 	if (ret) return -ret;
+	struct readdir_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fs = fs;
+	js_progress_init(&ctx.progress, fs, 0, 0);
 	char* block_buf = malloc(fs->blocksize);
 	ret = ext2fs_dir_iterate(
 		fs,
@@ -368,9 +711,16 @@ errcode_t node_ext2fs_readdir(ext2_filsys fs, char* path, int array_id) {
 		0,	// flags
 		block_buf,
 		copy_filename_to_result,
-		(void*)array_id
+		&ctx
 	);
 	free(block_buf);
+	if (!ret) {
+		ret = ctx.ret;
+	}
+	if (!ret) {
+		array_push_buffer(array_id, ctx.records, ctx.length);
+	}
+	free(ctx.records);
 	return -ret;
 }
 
@@ -404,10 +754,16 @@ unsigned int translate_open_flags(unsigned int js_flags) {
 long node_ext2fs_open(ext2_filsys fs, char* path, unsigned int flags, unsigned int mode) {
 	ext2_ino_t ino = string_to_inode(fs, path, !(flags & O_NOFOLLOW));
 	errcode_t ret;
+	if (is_read_only(fs) && (flags & (O_WRONLY | O_RDWR | O_TRUNC))) {
+		return -EROFS;
+	}
 	if (ino == 0) {
 		if (!(flags & O_CREAT)) {
 			return -ENOENT;
 		}
+		if (is_read_only(fs)) {
+			return -EROFS;
+		}
 		ret = create_file(fs, path, mode, &ino);
 		if (ret) return -ret;
 	} else if (flags & O_EXCL) {
@@ -419,9 +775,15 @@ long node_ext2fs_open(ext2_filsys fs, char* path, unsigned int flags, unsigned i
 	ext2_file_t file;
 	ret = ext2fs_file_open(fs, ino, translate_open_flags(flags), &file);
 	if (ret) return -ret;
+	ret = load_file_inode(file);
+	if (ret) {
+		ext2fs_file_close(file);
+		return -ret;
+	}
 	if (flags & O_TRUNC) {
 		ret = ext2fs_file_set_size2(file, 0);
 		if (ret) return -ret;
+		js_icache_refresh(fs, ino, &(file->inode), sizeof(file->inode));
 	}
 	return (long)file;
 }
@@ -442,10 +804,12 @@ long node_ext2fs_read(
 		ret = ext2fs_file_llseek(file, position, EXT2_SEEK_SET, NULL);
 		if (ret) return -ret;
 	}
+	ret = load_file_inode(file);
+	if (ret) return -ret;
 	unsigned int got;
 	ret = ext2fs_file_read(file, buffer, length, &got);
 	if (ret) return -ret;
-	if ((flags & O_NOATIME) == 0) {
+	if ((flags & O_NOATIME) == 0 && !is_read_only(file->fs)) {
 		ret = update_xtime(file, true, false, false);
 		if (ret) return -ret;
 	}
@@ -463,7 +827,12 @@ long node_ext2fs_write(
 		// Don't try to write to readonly files.
 		return -EBADF;
 	}
-	errcode_t ret = 0;
+	if (is_read_only(file->fs)) {
+		return -EROFS;
+	}
+	// The size of the file may have changed through another descriptor.
+	errcode_t ret = load_file_inode(file);
+	if (ret) return -ret;
 	if ((flags & O_APPEND) != 0) {
 		// append mode: seek to the end before each write
 		ret = ext2fs_file_llseek(file, 0, EXT2_SEEK_END, NULL);
@@ -474,6 +843,7 @@ long node_ext2fs_write(
 	if (ret) return -ret;
 	unsigned int written;
 	ret = ext2fs_file_write(file, buffer, length, &written);
+	js_icache_refresh(file->fs, file->ino, &(file->inode), sizeof(file->inode));
 	if (ret) return -ret;
 	if ((flags & O_CREAT) != 0) {
 		ret = update_xtime(file, false, true, true);
@@ -481,6 +851,7 @@ long node_ext2fs_write(
 	}
 
 	ret = ext2fs_file_flush(file);
+	js_icache_refresh(file->fs, file->ino, &(file->inode), sizeof(file->inode));
 	if (ret) {
 		ret = translate_error(file->fs, file->ino, ret);
 	}
@@ -494,6 +865,9 @@ errcode_t node_ext2fs_mkdir(
 	const char *path,
 	int mode
 ) {
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
 	ext2_ino_t parent_ino = get_parent_dir_ino(fs, path);
 	if (parent_ino == 0) {
 		return -ENOTDIR;
@@ -513,13 +887,17 @@ errcode_t node_ext2fs_mkdir(
 		&newdir
 	);
 	if (ret) return -ret;
+	// ext2fs_mkdir writes the parent inode (links count, size).
+	ret = js_icache_flush(fs, parent_ino);
+	if (ret) return -ret;
 	ret = ext2fs_mkdir(fs, parent_ino, newdir, filename);
+	js_dcache_invalidate(fs, parent_ino, filename, strlen(filename));
 	if (ret) return -ret;
 	struct ext2_inode inode;
-	ret = ext2fs_read_inode(fs, newdir, &inode);
- if (ret) return -ret;
+	ret = js_icache_read(fs, newdir, &inode, sizeof(inode));
+	if (ret) return -ret;
 	inode.i_mode = (mode & ~LINUX_S_IFMT) | LINUX_S_IFDIR;
-	ret = ext2fs_write_inode(fs, newdir, &inode);
+	ret = js_icache_write(fs, newdir, &inode, sizeof(inode));
 	return -ret;
 }
 
@@ -557,14 +935,17 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 	int ret = 0;
 
 	dbg_pf("%s: renaming %s to %s\n", __func__, from, to);
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, from, &from_ino);
+	err = lookup_path(fs, from, 0, &from_ino);
 	if (err || from_ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
 	}
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, to, &to_ino);
+	err = lookup_path(fs, to, 0, &to_ino);
 	if (err && err != EXT2_ET_FILE_NOT_FOUND) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -600,8 +981,7 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 
 	a = *(cp + 1);
 	*(cp + 1) = 0;
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_from,
-				 &from_dir_ino);
+	err = lookup_path(fs, temp_from, 0, &from_dir_ino);
 	*(cp + 1) = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -621,8 +1001,7 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 
 	a = *(cp + 1);
 	*(cp + 1) = 0;
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_to,
-				 &to_dir_ino);
+	err = lookup_path(fs, temp_to, 0, &to_dir_ino);
 	*(cp + 1) = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
@@ -635,7 +1014,7 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 
 	/* If the target exists, unlink it first */
 	if (to_ino != 0) {
-		err = ext2fs_read_inode(fs, to_ino, &inode);
+		err = js_icache_read(fs, to_ino, &inode, sizeof(inode));
 		if (err) {
 			ret = translate_error(fs, to_ino, err);
 			goto out2;
@@ -653,12 +1032,19 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 	}
 
 	/* Get ready to do the move */
-	err = ext2fs_read_inode(fs, from_ino, &inode);
+	err = js_icache_read(fs, from_ino, &inode, sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, from_ino, err);
 		goto out2;
 	}
 
+	/* Expanding the directory writes its inode */
+	err = js_icache_flush(fs, to_dir_ino);
+	if (err) {
+		ret = translate_error(fs, to_dir_ino, err);
+		goto out2;
+	}
+
 	/* Link in the new file */
 	dbg_pf("%s: linking ino=%d/path=%s to dir=%d\n", __func__,
 			 from_ino, cp + 1, to_dir_ino);
@@ -674,13 +1060,14 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 		err = ext2fs_link(fs, to_dir_ino, cp + 1, from_ino,
 						 ext2_file_type(inode.i_mode));
 	}
+	js_dcache_invalidate(fs, to_dir_ino, cp + 1, strlen(cp + 1));
 	if (err) {
 		ret = translate_error(fs, to_dir_ino, err);
 		goto out2;
 	}
 
 	/* Update '..' pointer if dir */
-	err = ext2fs_read_inode(fs, from_ino, &inode);
+	err = js_icache_read(fs, from_ino, &inode, sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, from_ino, err);
 		goto out2;
@@ -700,26 +1087,26 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 		/* Decrease from_dir_ino's links_count */
 		dbg_pf("%s: moving linkcount from dir=%d to dir=%d\n",
 				 __func__, from_dir_ino, to_dir_ino);
-		err = ext2fs_read_inode(fs, from_dir_ino, &inode);
+		err = js_icache_read(fs, from_dir_ino, &inode, sizeof(inode));
 		if (err) {
 			ret = translate_error(fs, from_dir_ino, err);
 			goto out2;
 		}
 		inode.i_links_count--;
-		err = ext2fs_write_inode(fs, from_dir_ino, &inode);
+		err = js_icache_write(fs, from_dir_ino, &inode, sizeof(inode));
 		if (err) {
 			ret = translate_error(fs, from_dir_ino, err);
 			goto out2;
 		}
 
 		/* Increase to_dir_ino's links_count */
-		err = ext2fs_read_inode(fs, to_dir_ino, &inode);
+		err = js_icache_read(fs, to_dir_ino, &inode, sizeof(inode));
 		if (err) {
 			ret = translate_error(fs, to_dir_ino, err);
 			goto out2;
 		}
 		inode.i_links_count++;
-		err = ext2fs_write_inode(fs, to_dir_ino, &inode);
+		err = js_icache_write(fs, to_dir_ino, &inode, sizeof(inode));
 		if (err) {
 			ret = translate_error(fs, to_dir_ino, err);
 			goto out2;
@@ -741,7 +1128,9 @@ errcode_t node_ext2fs_rename(ext2_filsys fs, const char *from, const char *to) {
 		goto out2;
 
 	/* Flush the whole mess out */
-	err = ext2fs_flush2(fs, 0);
+	err = js_icache_flush_all(fs);
+	if (!err)
+		err = ext2fs_flush2(fs, 0);
 	if (err)
 		ret = translate_error(fs, 0, err);
 
@@ -762,6 +1151,9 @@ errcode_t node_ext2fs_link(ext2_filsys fs, const char *src, const char *dest)
 	int ret = 0;
 
 	dbg_pf("%s: src=%s dest=%s\n", __func__, src, dest);
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
 	temp_path = strdup(dest);
 	if (!temp_path) {
 		ret = -ENOMEM;
@@ -776,7 +1168,7 @@ errcode_t node_ext2fs_link(ext2_filsys fs, const char *src, const char *dest)
 	a = *node_name;
 	*node_name = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path, &parent);
+	err = lookup_path(fs, temp_path, 0, &parent);
 	*node_name = a;
 	if (err) {
 		err = -ENOENT;
@@ -784,14 +1176,14 @@ errcode_t node_ext2fs_link(ext2_filsys fs, const char *src, const char *dest)
 	}
 
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, src, &ino);
+	err = lookup_path(fs, src, 0, &ino);
 	if (err || ino == 0) {
 		ret = translate_error(fs, 0, err);
 		goto out;
 	}
 
 	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
+	err = js_icache_read(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, ino, err);
 		goto out;
@@ -802,12 +1194,19 @@ errcode_t node_ext2fs_link(ext2_filsys fs, const char *src, const char *dest)
 	if (ret)
 		goto out;
 
-	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
+	err = js_icache_write(fs, ino, (struct ext2_inode *)&inode, sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, ino, err);
 		goto out;
 	}
 
+	// Expanding the directory writes its inode.
+	err = js_icache_flush(fs, parent);
+	if (err) {
+		ret = translate_error(fs, parent, err);
+		goto out;
+	}
+
 	dbg_pf("%s: linking ino=%d/name=%s to dir=%d\n", __func__, ino, node_name, parent);
 	err = ext2fs_link(fs, parent, node_name, ino, ext2_file_type(inode.i_mode));
 	if (err == EXT2_ET_DIR_NO_SPACE) {
@@ -819,6 +1218,7 @@ errcode_t node_ext2fs_link(ext2_filsys fs, const char *src, const char *dest)
 
 		err = ext2fs_link(fs, parent, node_name, ino, ext2_file_type(inode.i_mode));
 	}
+	js_dcache_invalidate(fs, parent, node_name, strlen(node_name));
 	if (err) {
 		ret = translate_error(fs, parent, err);
 		goto out;
@@ -842,6 +1242,9 @@ int node_ext2fs_symlink(ext2_filsys fs, const char *src, const char *dest) {
 	int ret = 0;
 
 	dbg_pf("%s: symlink %s to %s\n", __func__, src, dest);
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
 	temp_path = strdup(dest);
 	if (!temp_path) {
 		ret = -ENOMEM;
@@ -856,15 +1259,19 @@ int node_ext2fs_symlink(ext2_filsys fs, const char *src, const char *dest) {
 	a = *node_name;
 	*node_name = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-				 &parent);
+	err = lookup_path(fs, temp_path, 0, &parent);
 	*node_name = a;
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
 	}
 
-	/* Create symlink */
+	/* Create symlink, expanding the directory writes its inode */
+	err = js_icache_flush(fs, parent);
+	if (err) {
+		ret = translate_error(fs, parent, err);
+		goto out;
+	}
 	err = ext2fs_symlink(fs, parent, 0, node_name, src);
 	if (err == EXT2_ET_DIR_NO_SPACE) {
 		err = ext2fs_expand_dir(fs, parent);
@@ -875,6 +1282,7 @@ int node_ext2fs_symlink(ext2_filsys fs, const char *src, const char *dest) {
 
 		err = ext2fs_symlink(fs, parent, 0, node_name, src);
 	}
+	js_dcache_invalidate(fs, parent, node_name, strlen(node_name));
 	if (err) {
 		ret = translate_error(fs, parent, err);
 		goto out;
@@ -886,8 +1294,7 @@ int node_ext2fs_symlink(ext2_filsys fs, const char *src, const char *dest) {
 		goto out;
 
 	/* Still have to update the uid/gid of the symlink */
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, temp_path,
-				 &child);
+	err = lookup_path(fs, temp_path, 0, &child);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -896,14 +1303,14 @@ int node_ext2fs_symlink(ext2_filsys fs, const char *src, const char *dest) {
 			 child, node_name, parent);
 
 	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, child, (struct ext2_inode *)&inode,
+	err = js_icache_read(fs, child, (struct ext2_inode *)&inode,
 						 sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, child, err);
 		goto out;
 	}
 
-	err = ext2fs_write_inode_full(fs, child, (struct ext2_inode *)&inode,
+	err = js_icache_write(fs, child, (struct ext2_inode *)&inode,
 							sizeof(inode));
 	if (err) {
 		ret = translate_error(fs, child, err);
@@ -920,6 +1327,12 @@ static int remove_inode(ext2_filsys fs, ext2_ino_t ino)
 	struct ext2_inode_large inode;
 	int ret = 0;
 
+	/* Freeing the blocks goes through libext2fs, not the inode cache */
+	err = js_icache_flush(fs, ino);
+	if (err) {
+		ret = translate_error(fs, ino, err);
+		goto out;
+	}
 	memset(&inode, 0, sizeof(inode));
 	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
 						 sizeof(inode));
@@ -981,7 +1394,11 @@ errcode_t node_ext2fs_unlink(ext2_filsys fs, const char *path) {
 	errcode_t err;
 	int ret = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
+
+	err = lookup_path(fs, path, 0, &ino);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1011,8 +1428,7 @@ static int unlink_file_by_name(ext2_filsys fs, const char *path) {
 	base_name = strrchr(filename, '/');
 	if (base_name) {
 		*base_name++ = '\0';
-		err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, filename,
-					 &dir);
+		err = lookup_path(fs, filename, 0, &dir);
 		if (err) {
 			free(filename);
 			return translate_error(fs, 0, err);
@@ -1025,6 +1441,7 @@ static int unlink_file_by_name(ext2_filsys fs, const char *path) {
 	dbg_pf("%s: unlinking name=%s from dir=%d\n", __func__,
 			 base_name, dir);
 	err = ext2fs_unlink(fs, dir, base_name, 0, 0);
+	js_dcache_invalidate(fs, dir, base_name, strlen(base_name));
 	free(filename);
 	if (err)
 		return translate_error(fs, dir, err);
@@ -1044,7 +1461,11 @@ errcode_t node_ext2fs_rmdir(ext2_filsys fs, const char *path) {
 	struct rd_struct rds;
 	int ret = 0;
 
-	err = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &child);
+	if (is_read_only(fs)) {
+		return -EROFS;
+	}
+
+	err = lookup_path(fs, path, 0, &child);
 	if (err) {
 		ret = translate_error(fs, 0, err);
 		goto out;
@@ -1076,11 +1497,13 @@ errcode_t node_ext2fs_rmdir(ext2_filsys fs, const char *path) {
 	ret = remove_inode(fs, child);
 	if (ret)
 		goto out;
+	// The inode number can be reused by a new directory.
+	js_dcache_invalidate_dir(fs, child);
 
 	if (rds.parent) {
 		dbg_pf("%s: decr dir=%d link count\n", __func__,
 				 rds.parent);
-		err = ext2fs_read_inode_full(fs, rds.parent,
+		err = js_icache_read(fs, rds.parent,
 							 (struct ext2_inode *)&inode,
 							 sizeof(inode));
 		if (err) {
@@ -1092,7 +1515,7 @@ errcode_t node_ext2fs_rmdir(ext2_filsys fs, const char *path) {
 		ret = update_mtime(fs, rds.parent, &inode);
 		if (ret)
 			goto out;
-		err = ext2fs_write_inode_full(fs, rds.parent,
+		err = js_icache_write(fs, rds.parent,
 								(struct ext2_inode *)&inode,
 								sizeof(inode));
 		if (err) {
@@ -1131,14 +1554,17 @@ static int rmdir_proc(
 
 
 errcode_t node_ext2fs_chmod(ext2_file_t file, int mode) {
-	errcode_t ret = ext2fs_read_inode(file->fs, file->ino, &(file->inode));
+	if (is_read_only(file->fs)) {
+		return -EROFS;
+	}
+	errcode_t ret = load_file_inode(file);
 	if (ret) return -ret;
 	// keep only fmt (file or directory)
 	file->inode.i_mode &= LINUX_S_IFMT;
 	// apply new mode
 	file->inode.i_mode |= (mode & ~LINUX_S_IFMT);
 	increment_version(&(file->inode));
-	ret = ext2fs_write_inode(file->fs, file->ino, &(file->inode));
+	ret = js_icache_write(file->fs, file->ino, &(file->inode), sizeof(file->inode));
 	return -ret;
 }
 
@@ -1147,52 +1573,46 @@ errcode_t node_ext2fs_chown(
 	int uid,
 	int gid
 ) {
-	// TODO handle 32 bit {u,g}ids
-	errcode_t ret = ext2fs_read_inode(file->fs, file->ino, &(file->inode));
+	if (is_read_only(file->fs)) {
+		return -EROFS;
+	}
+	errcode_t ret = load_file_inode(file);
 	if (ret) return -ret;
-	// keep only the lower 16 bits
 	file->inode.i_uid = uid & 0xFFFF;
 	file->inode.i_gid = gid & 0xFFFF;
+	file->inode.osd2.linux2.l_i_uid_high = (uid >> 16) & 0xFFFF;
+	file->inode.osd2.linux2.l_i_gid_high = (gid >> 16) & 0xFFFF;
 	increment_version(&(file->inode));
-	ret = ext2fs_write_inode(file->fs, file->ino, &(file->inode));
+	ret = js_icache_write(file->fs, file->ino, &(file->inode), sizeof(file->inode));
 	return -ret;
 }
 
-errcode_t node_ext2fs_readlink(
+// Pushes the target of the symlink `ino` to the js array `array_id`.
+static errcode_t push_link_target(
 	ext2_filsys fs,
-	const char* path,
+	ext2_ino_t ino,
+	struct ext2_inode *ei,
 	int array_id
 ) {
 	errcode_t ret = 0;
-	struct ext2_inode ei;
 	char* buffer = 0;
 	char* pathname;
 	blk64_t blk;
 
-	ext2_ino_t ino = string_to_inode(fs, path, 0);
-	if (!ino) {
-		return -ENOENT;
-	}
-
-	ret = ext2fs_read_inode(fs, ino, &ei);
-	if (ret) {
-		return -ret;
-	}
-
-	if (!LINUX_S_ISLNK(ei.i_mode)) {
+	if (!LINUX_S_ISLNK(ei->i_mode)) {
 		return -EINVAL;
 	}
 
-	if (ext2fs_is_fast_symlink(&ei)) {
-		pathname = (char *)&(ei.i_block[0]);
+	if (ext2fs_is_fast_symlink(ei)) {
+		pathname = (char *)&(ei->i_block[0]);
 	}
-	else if (ei.i_flags & EXT4_INLINE_DATA_FL) {
-		ret = ext2fs_get_memzero(ei.i_size, &buffer);
+	else if (ei->i_flags & EXT4_INLINE_DATA_FL) {
+		ret = ext2fs_get_memzero(ei->i_size, &buffer);
 		if (ret) {
 			return -ret;
 		}
 
-		ret = ext2fs_inline_data_get(fs, ino, &ei, buffer, NULL);
+		ret = ext2fs_inline_data_get(fs, ino, ei, buffer, NULL);
 		if (ret) {
 			ext2fs_free_mem(&buffer);
 			return -ret;
@@ -1200,7 +1620,7 @@ errcode_t node_ext2fs_readlink(
 
 		pathname = buffer;
 	} else {
-		ret = ext2fs_bmap2(fs, ino, &ei, NULL, 0, 0, NULL, &blk);
+		ret = ext2fs_bmap2(fs, ino, ei, NULL, 0, 0, NULL, &blk);
 		if (ret) {
 			return -ret;
 		}
@@ -1228,8 +1648,44 @@ errcode_t node_ext2fs_readlink(
 	return ret;
 }
 
+errcode_t node_ext2fs_readlink(
+	ext2_filsys fs,
+	const char* path,
+	int array_id
+) {
+	errcode_t ret = 0;
+	struct ext2_inode ei;
+
+	ext2_ino_t ino = string_to_inode(fs, path, 0);
+	if (!ino) {
+		return -ENOENT;
+	}
+
+	ret = js_icache_read(fs, ino, &ei, sizeof(ei));
+	if (ret) {
+		return -ret;
+	}
+
+	return push_link_target(fs, ino, &ei, array_id);
+}
+
 errcode_t node_ext2fs_close(ext2_file_t file) {
-	return -ext2fs_file_close(file);
+	ext2_filsys fs = file->fs;
+	ext2_ino_t ino = file->ino;
+	// file->inode may be stale if the inode changed through another handle or
+	// a path operation (link, chmod...) since this handle last used it.
+	// Reload it first: flushing may write it, and it then replaces the cached
+	// copy.
+	errcode_t ret = load_file_inode(file);
+	if (ret == 0) {
+		ret = ext2fs_file_flush(file);
+		js_icache_refresh(fs, ino, &(file->inode), sizeof(file->inode));
+	}
+	if (ret == 0) {
+		ret = js_icache_flush(fs, ino);
+	}
+	errcode_t close_ret = ext2fs_file_close(file);
+	return -(ret ? ret : close_ret);
 }
 
 static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
@@ -1242,14 +1698,14 @@ static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
 
 	/* If user already has a inode buffer, just update that */
 	if (pinode) {
-	increment_version((struct ext2_inode *) &inode);
+		increment_version((struct ext2_inode *) pinode);
 		EXT4_INODE_SET_XTIME(i_ctime, &now, pinode);
 		return 0;
 	}
 
 	/* Otherwise we have to read-modify-write the inode */
 	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_read(fs, ino, (struct ext2_inode *)&inode,
 						 sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1257,7 +1713,7 @@ static int update_ctime(ext2_filsys fs, ext2_ino_t ino,
 	increment_version((struct ext2_inode *) &inode);
 	EXT4_INODE_SET_XTIME(i_ctime, &now, &inode);
 
-	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_write(fs, ino, (struct ext2_inode *)&inode,
 							sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1273,7 +1729,7 @@ static int update_atime(ext2_filsys fs, ext2_ino_t ino) {
 	if (!(fs->flags & EXT2_FLAG_RW))
 		return 0;
 	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_read(fs, ino, (struct ext2_inode *)&inode,
 						 sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1290,7 +1746,7 @@ static int update_atime(ext2_filsys fs, ext2_ino_t ino) {
 		return 0;
 	EXT4_INODE_SET_XTIME(i_atime, &now, &inode);
 
-	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_write(fs, ino, (struct ext2_inode *)&inode,
 							sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1313,7 +1769,7 @@ static int update_mtime(ext2_filsys fs, ext2_ino_t ino,
 	}
 
 	memset(&inode, 0, sizeof(inode));
-	err = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_read(fs, ino, (struct ext2_inode *)&inode,
 						 sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1323,7 +1779,7 @@ static int update_mtime(ext2_filsys fs, ext2_ino_t ino,
 	EXT4_INODE_SET_XTIME(i_ctime, &now, &inode);
 	increment_version((struct ext2_inode *) &inode);
 
-	err = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)&inode,
+	err = js_icache_write(fs, ino, (struct ext2_inode *)&inode,
 							sizeof(inode));
 	if (err)
 		return translate_error(fs, ino, err);
@@ -1357,122 +1813,1659 @@ static int ext2_file_type(unsigned int mode) {
 }
 
 
-int node_ext2fs_stat_i_mode(ext2_file_t file) {
-	return file->inode.i_mode;
-}
-
-int node_ext2fs_stat_i_links_count(ext2_file_t file) {
-	return file->inode.i_links_count;
-}
-
-int node_ext2fs_stat_i_uid(ext2_file_t file) {
-	return file->inode.i_uid;
+// Number of 512 bytes sectors, like ext2fs_get_stat_i_blocks.
+static double inode_blocks(ext2_filsys fs, const struct ext2_inode_large *inode) {
+	double blocks = inode->i_blocks;
+	if (ext2fs_has_feature_huge_file(fs->super)) {
+		blocks += (double)inode->osd2.linux2.l_i_blocks_hi * 4294967296.0;
+		if (inode->i_flags & EXT4_HUGE_FILE_FL) {
+			blocks *= fs->blocksize / 512;
+		}
+	}
+	return blocks;
 }
 
-int node_ext2fs_stat_i_gid(ext2_file_t file) {
-	return file->inode.i_gid;
+// Fills `out` with the fields of `inode`, see statsFromFields in lib/fs.js.
+static void fill_stat(
+	ext2_filsys fs,
+	ext2_ino_t ino,
+	const struct ext2_inode_large *inode,
+	struct node_ext2fs_stat *out
+) {
+	struct timespec atime, mtime, ctime;
+	EXT4_INODE_GET_XTIME(i_atime, &atime, inode);
+	EXT4_INODE_GET_XTIME(i_mtime, &mtime, inode);
+	EXT4_INODE_GET_XTIME(i_ctime, &ctime, inode);
+	out->ino = ino;
+	out->mode = inode->i_mode;
+	out->nlink = inode->i_links_count;
+	out->uid = inode->i_uid | ((unsigned int)inode->osd2.linux2.l_i_uid_high << 16);
+	out->gid = inode->i_gid | ((unsigned int)inode->osd2.linux2.l_i_gid_high << 16);
+	out->size = getUInt64Number(inode->i_size_high, inode->i_size);
+	out->blocks = inode_blocks(fs, inode);
+	out->blksize = fs->blocksize;
+	out->atime = atime.tv_sec;
+	out->mtime = mtime.tv_sec;
+	out->ctime = ctime.tv_sec;
+	out->atime_nsec = atime.tv_nsec;
+	out->mtime_nsec = mtime.tv_nsec;
+	out->ctime_nsec = ctime.tv_nsec;
 }
 
-int node_ext2fs_stat_blocksize(ext2_file_t file) {
-	return file->fs->blocksize;
+// Fills `out` for an open file, in a single call.
+errcode_t node_ext2fs_fstat(ext2_file_t file, struct node_ext2fs_stat *out) {
+	struct ext2_inode_large inode;
+	errcode_t ret;
+	memset(&inode, 0, sizeof(inode));
+	ret = js_icache_read(file->fs, file->ino, (struct ext2_inode *)&inode, sizeof(inode));
+	if (ret) return -ret;
+	fill_stat(file->fs, file->ino, &inode, out);
+	return 0;
 }
 
-double node_ext2fs_stat_i_size(ext2_file_t file) {
-	return getUInt64Number(file->inode.i_size_high, file->inode.i_size);
-}
-
-int node_ext2fs_stat_ino(ext2_file_t file) {
-	return file->ino;
-}
-
-int node_ext2fs_stat_i_blocks(ext2_file_t file) {
-	return file->inode.i_blocks;
+// Resolves `path` and reads its inode through the inode cache, returns a
+// negative errno.
+static errcode_t read_path_inode(
+	ext2_filsys fs,
+	const char *path,
+	int follow,
+	ext2_ino_t *ino,
+	struct ext2_inode_large *inode
+) {
+	errcode_t ret;
+	*ino = string_to_inode(fs, path, follow);
+	if (*ino == 0) {
+		return -ENOENT;
+	}
+	memset(inode, 0, sizeof(*inode));
+	ret = js_icache_read(fs, *ino, (struct ext2_inode *)inode, sizeof(*inode));
+	return -ret;
 }
 
-int node_ext2fs_stat_i_atime(ext2_file_t file) {
-	return file->inode.i_atime;
+// stat, or lstat without `follow`, of `path` without opening it.
+errcode_t node_ext2fs_stat(
+	ext2_filsys fs,
+	const char *path,
+	int follow,
+	struct node_ext2fs_stat *out
+) {
+	struct ext2_inode_large inode;
+	ext2_ino_t ino;
+	errcode_t ret = read_path_inode(fs, path, follow, &ino, &inode);
+	if (ret) return ret;
+	fill_stat(fs, ino, &inode, out);
+	return 0;
 }
 
-int node_ext2fs_stat_i_mtime(ext2_file_t file) {
-	return file->inode.i_mtime;
+static errcode_t batch_entry(
+	ext2_filsys fs,
+	const struct node_ext2fs_batch_op *op,
+	const char *paths,
+	int array_id,
+	int *links,
+	struct node_ext2fs_batch_result *result
+) {
+	struct ext2_inode_large inode;
+	ext2_ino_t ino;
+	errcode_t ret = read_path_inode(fs, paths + op->path, op->op == BATCH_STAT, &ino, &inode);
+	if (ret) return ret;
+	switch (op->op) {
+		case BATCH_STAT:
+		case BATCH_LSTAT:
+			fill_stat(fs, ino, &inode, &result->stat);
+			return 0;
+		case BATCH_READLINK:
+			ret = push_link_target(fs, ino, (struct ext2_inode *)&inode, array_id);
+			if (ret) return ret;
+			result->link = (*links)++;
+			return 0;
+	}
+	return -EINVAL;
 }
 
-int node_ext2fs_stat_i_ctime(ext2_file_t file) {
-	return file->inode.i_ctime;
+// Runs `count` operations in a single call, each one gets its own errno in
+// `results`. Targets of readlink operations are pushed to the js array
+// `array_id`.
+errcode_t node_ext2fs_batch(
+	ext2_filsys fs,
+	const struct node_ext2fs_batch_op *ops,
+	const char *paths,
+	int count,
+	struct node_ext2fs_batch_result *results,
+	int array_id
+) {
+	struct js_progress progress;
+	errcode_t ret;
+	int i;
+	int links = 0;
+	js_progress_init(&progress, fs, 0, count);
+	for (i = 0; i < count; i++) {
+		if ((ret = js_progress_update(&progress, i))) {
+			return -ret;
+		}
+		memset(&results[i], 0, sizeof(results[i]));
+		results[i].error = batch_entry(fs, &ops[i], paths, array_id, &links, &results[i]);
+	}
+	return 0;
 }
 
 errcode_t node_ext2fs_umount(ext2_filsys fs) {
+	errcode_t ret = js_icache_flush_all(fs);
+	if (ret) return -ret;
 	return -ext2fs_close(fs);
 }
 //-------------------------------------------
+
+// Block cache ------------
+// Write-back LRU cache of disk blocks, modeled after the one in unix_io.c.
+// Every cache miss costs an Asyncify unwind/rewind and a round trip through
+// the js disk, so hot metadata blocks are kept here instead.
+
+#define CACHE_DEFAULT_SIZE	(1024 * 1024)	// bytes, overridden with the cache_size io option
+#define CACHE_DIRECT_SIZE	4	// requests larger than this (in blocks) bypass the cache
+#define READAHEAD_DEFAULT_SIZE	(128 * 1024)	// bytes, overridden with the readahead io option
+#define READAHEAD_MIN_BLOCKS	4	// first window once a sequential stream is detected
+#define WRITEBACK_BATCH_SIZE	(1024 * 1024)	// bytes, maximum size of a single gathered write
+#define ZEROOUT_CHUNK_SIZE	(256 * 1024)	// bytes, size of the shared zero buffer
+#define ZEROOUT_BATCH		64	// zero buffer writes per blk_writev
+#define YIELD_DEFAULT_INTERVAL	10	// ms, overridden with the yield_interval io option
+#define PROGRESS_CHECK_CALLS	64	// progress updates between two clock reads
+#define DCACHE_DEFAULT_SIZE	1024	// entries, overridden with the dentry_cache io option
+#define ICACHE_DEFAULT_SIZE	256	// inodes, overridden with the inode_cache io option
+
+// Disk request statistics. Every field is a double so that js can read the
+// structure through HEAPF64, see lib/stats.js which must match this layout.
+#define IO_STATS_BUCKETS	16
+
+enum {
+	IO_STAT_READ,
+	IO_STAT_WRITE,
+	IO_STAT_DISCARD,
+	IO_STAT_FLUSH,
+	IO_STAT_ZEROOUT,
+	IO_STAT_TYPES
+};
+
+struct js_io_op_stats {
+	double	calls;
+	double	ranges;	// contiguous ranges, a gathered write or a discard batch has several
+	double	sequential;	// ranges starting where the previous one of the same type ended
+	double	blocks;
+	double	metadata_blocks;	// blocks in the metadata map, see js_load_metadata_map
+	double	bytes;
+	double	time;	// total, in milliseconds
+	double	latency[IO_STATS_BUCKETS];
+	double	sizes[IO_STATS_BUCKETS];	// sizes[i] counts ranges of up to 2^i blocks, the last one the rest
+};
+
+struct js_io_stats {
+	struct js_io_op_stats	ops[IO_STAT_TYPES];
+	double			cache_hits;	// in blocks
+	double			cache_misses;	// in blocks
+	double			zeroout_writes;	// zero-out requests written from zero_buf, the disk has no zeroOut
+};
+
+struct js_extent {
+	unsigned long long	block;
+	unsigned long long	count;
+};
+
+struct js_cache_entry {
+	unsigned long long	block;
+	int			dirty;
+	struct js_cache_entry	*hash_next;
+	struct js_cache_entry	*lru_prev;
+	struct js_cache_entry	*lru_next;
+	char			buf[];
+};
+
+struct js_dentry {
+	ext2_ino_t		dir;
+	ext2_ino_t		ino;	// 0 for a name that doesn't exist
+	int			is_link;
+	unsigned int		hash;
+	int			name_len;
+	struct js_dentry	*hash_next;
+	struct js_dentry	*lru_prev;
+	struct js_dentry	*lru_next;
+	char			name[];	// name_len bytes, not NUL terminated
+};
+
+struct js_inode_entry {
+	ext2_ino_t		ino;
+	int			dirty;
+	struct js_inode_entry	*hash_next;
+	struct js_inode_entry	*lru_prev;
+	struct js_inode_entry	*lru_next;
+	struct ext2_inode_large	inode;
+};
+
+struct js_private_data {
+	int			disk_id;
+	int			capabilities;	// DISK_CAP_* flags
+	unsigned long		cache_size;	// in bytes, 0 disables the cache
+	int			cache_max;	// in blocks, derived from cache_size and the block size
+	int			cache_count;
+	int			dirty_count;
+	unsigned long		dirty_size;	// in bytes, dirty blocks are written back past this, 0 means half the cache
+	unsigned int		hash_mask;
+	struct js_cache_entry	**hash;
+	struct js_cache_entry	lru;	// list head: lru.lru_next is the most recently used entry
+	unsigned long		readahead_size;	// in bytes, maximum readahead window, 0 disables readahead
+	unsigned long long	ra_next;	// block a sequential stream would miss on next
+	int			ra_window;	// current readahead window, in blocks
+	char			*ra_buf;	// staging buffer of readahead_size bytes
+	unsigned long		discard_granularity;	// in bytes, batched discards are aligned to this
+	struct js_io_stats	*stats;	// own_stats, or the buffer given with the stats io option
+	struct js_io_stats	own_stats;
+	struct struct_io_stats	io_stats;	// for get_stats
+	double			last_end[IO_STAT_TYPES];	// byte offset where the last range of each type ended
+	struct js_extent	*metadata;	// sorted, non-overlapping metadata block extents
+	int			metadata_count;
+	int			read_only;	// opened without IO_FLAG_RW: no writes, discards or flushes
+	unsigned long		yield_interval;	// in ms, long operations yield to js this often, 0 never
+	struct js_progress	*progress;	// counts reads while set, see js_set_channel_progress
+	int			dcache_max;	// in entries, 0 disables the dentry cache
+	int			dcache_count;
+	unsigned int		dcache_mask;
+	struct js_dentry	**dcache_hash;
+	struct js_dentry	dcache_lru;	// list head: dcache_lru.lru_next is the most recently used entry
+	int			icache_max;	// in inodes, 0 makes js_icache_write write through
+	int			icache_count;
+	unsigned int		icache_mask;
+	struct js_inode_entry	**icache_hash;
+	struct js_inode_entry	icache_lru;	// list head: icache_lru.lru_next is the most recently used entry
+};
+
+static struct js_private_data *get_private_data(io_channel channel) {
+	return (struct js_private_data *)channel->private_data;
+}
+
 int get_disk_id(io_channel channel) {
-	return (int)channel->private_data;
+	return get_private_data(channel)->disk_id;
+}
+
+static int latency_bucket(double ms) {
+	double limit = 0.001;	// 1us
+	int i;
+	for (i = 0; i < IO_STATS_BUCKETS - 1 && ms >= limit; i++) {
+		limit *= 2;
+	}
+	return i;
+}
+
+static int size_bucket(unsigned long long blocks) {
+	unsigned long long limit = 1;
+	int i;
+	for (i = 0; i < IO_STATS_BUCKETS - 1 && blocks > limit; i++) {
+		limit *= 2;
+	}
+	return i;
+}
+
+// Number of blocks of [block, block + count) that are in the metadata map.
+static unsigned long long metadata_blocks(struct js_private_data *data, unsigned long long block, unsigned long long count) {
+	unsigned long long end = block + count, total = 0, from, to;
+	int lo = 0, hi = data->metadata_count, mid;
+	// First extent ending after block.
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (data->metadata[mid].block + data->metadata[mid].count <= block) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; lo < data->metadata_count && data->metadata[lo].block < end; lo++) {
+		from = data->metadata[lo].block > block ? data->metadata[lo].block : block;
+		to = data->metadata[lo].block + data->metadata[lo].count;
+		if (to > end) {
+			to = end;
+		}
+		total += to - from;
+	}
+	return total;
+}
+
+// Accounts for one contiguous range of a request of the given type.
+static void account_range(io_channel channel, int type, double offset, double bytes) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_io_op_stats *op = &data->stats->ops[type];
+	unsigned long long block = offset / channel->block_size;
+	unsigned long long blocks = ceil(bytes / channel->block_size);
+	op->ranges++;
+	if (offset == data->last_end[type]) {
+		op->sequential++;
+	}
+	data->last_end[type] = offset + bytes;
+	op->blocks += blocks;
+	op->metadata_blocks += metadata_blocks(data, block, blocks);
+	op->bytes += bytes;
+	op->sizes[size_bucket(blocks)]++;
+	if (type == IO_STAT_READ) {
+		data->io_stats.bytes_read += bytes;
+	} else if (type == IO_STAT_WRITE) {
+		data->io_stats.bytes_written += bytes;
+	}
+}
+
+// Accounts for one disk request of the given type that started at `start`
+// (from emscripten_get_now), its ranges are accounted for separately.
+static void account_io(io_channel channel, int type, double start) {
+	struct js_io_op_stats *op = &get_private_data(channel)->stats->ops[type];
+	double ms = emscripten_get_now() - start;
+	op->calls++;
+	op->time += ms;
+	op->latency[latency_bucket(ms)]++;
+}
+
+// The raw_* helpers are the only places requests reach the disk. They use the
+// synchronous js imports when the disk has them, so that the whole operation
+// runs without an Asyncify unwind / rewind, and account for every request.
+static errcode_t raw_read_blk(io_channel channel, unsigned long long block, int count, void *buf) {
+	struct js_private_data *data = get_private_data(channel);
+	double offset = (double)block * channel->block_size;
+	unsigned int length = count < 0 ? -count : count * channel->block_size;
+	double start = emscripten_get_now();
+	errcode_t ret;
+	if (data->capabilities & DISK_CAP_READSYNC) {
+		ret = blk_read_sync(data->disk_id, offset, length, buf);
+	} else {
+		ret = blk_read(data->disk_id, offset, length, buf);
+	}
+	account_io(channel, IO_STAT_READ, start);
+	account_range(channel, IO_STAT_READ, offset, length);
+	return ret;
+}
+
+static errcode_t raw_write_blk(io_channel channel, unsigned long long block, int count, const void *buf) {
+	struct js_private_data *data = get_private_data(channel);
+	double offset = (double)block * channel->block_size;
+	unsigned int length = count < 0 ? -count : count * channel->block_size;
+	double start = emscripten_get_now();
+	errcode_t ret;
+	if (data->capabilities & DISK_CAP_WRITESYNC) {
+		ret = blk_write_sync(data->disk_id, offset, length, buf);
+	} else {
+		ret = blk_write(data->disk_id, offset, length, buf);
+	}
+	account_io(channel, IO_STAT_WRITE, start);
+	account_range(channel, IO_STAT_WRITE, offset, length);
+	return ret;
+}
+
+static errcode_t raw_writev(io_channel channel, const struct js_write_segment *segments, int count) {
+	struct js_private_data *data = get_private_data(channel);
+	double start = emscripten_get_now();
+	errcode_t ret;
+	int i;
+	if (data->capabilities & DISK_CAP_WRITESYNC) {
+		ret = blk_writev_sync(data->disk_id, segments, count);
+	} else {
+		ret = blk_writev(data->disk_id, segments, count);
+	}
+	account_io(channel, IO_STAT_WRITE, start);
+	for (i = 0; i < count; i++) {
+		account_range(channel, IO_STAT_WRITE, segments[i].offset, segments[i].length);
+	}
+	return ret;
+}
+
+static errcode_t raw_flush(io_channel channel) {
+	struct js_private_data *data = get_private_data(channel);
+	double start = emscripten_get_now();
+	errcode_t ret;
+	if (data->capabilities & DISK_CAP_FLUSHSYNC) {
+		ret = flush_sync(data->disk_id);
+	} else {
+		ret = flush(data->disk_id);
+	}
+	account_io(channel, IO_STAT_FLUSH, start);
+	return ret;
+}
+
+static errcode_t raw_discard(io_channel channel, double offset, double length) {
+	double start = emscripten_get_now();
+	errcode_t ret = discard(get_disk_id(channel), offset, length);
+	account_io(channel, IO_STAT_DISCARD, start);
+	account_range(channel, IO_STAT_DISCARD, offset, length);
+	return ret;
+}
+
+static errcode_t raw_discard_ranges(io_channel channel, const struct js_discard_range *ranges, int count) {
+	double start = emscripten_get_now();
+	int i;
+	errcode_t ret = discard_ranges(get_disk_id(channel), ranges, count);
+	account_io(channel, IO_STAT_DISCARD, start);
+	for (i = 0; i < count; i++) {
+		account_range(channel, IO_STAT_DISCARD, ranges[i].offset, ranges[i].length);
+	}
+	return ret;
+}
+
+static errcode_t raw_zero_out(io_channel channel, double offset, double length) {
+	double start = emscripten_get_now();
+	errcode_t ret = zero_out(get_disk_id(channel), offset, length);
+	account_io(channel, IO_STAT_ZEROOUT, start);
+	account_range(channel, IO_STAT_ZEROOUT, offset, length);
+	return ret;
+}
+
+// Number of blocks touched by a request, count < 0 is a size in bytes.
+static unsigned long long count_to_blocks(io_channel channel, long long count) {
+	if (count < 0) {
+		return (-count + channel->block_size - 1) / channel->block_size;
+	}
+	return count;
+}
+
+static unsigned int cache_hash(struct js_private_data *data, unsigned long long block) {
+	return (unsigned int)(block ^ (block >> 32)) & data->hash_mask;
+}
+
+static struct js_cache_entry *find_cached_block(struct js_private_data *data, unsigned long long block) {
+	if (data->hash == NULL) {
+		return NULL;
+	}
+	struct js_cache_entry *cache = data->hash[cache_hash(data, block)];
+	while (cache && cache->block != block) {
+		cache = cache->hash_next;
+	}
+	return cache;
+}
+
+static void lru_unlink(struct js_cache_entry *cache) {
+	cache->lru_prev->lru_next = cache->lru_next;
+	cache->lru_next->lru_prev = cache->lru_prev;
+}
+
+static void lru_push_front(struct js_private_data *data, struct js_cache_entry *cache) {
+	cache->lru_prev = &data->lru;
+	cache->lru_next = data->lru.lru_next;
+	data->lru.lru_next->lru_prev = cache;
+	data->lru.lru_next = cache;
+}
+
+static void touch_cached_block(struct js_private_data *data, struct js_cache_entry *cache) {
+	lru_unlink(cache);
+	lru_push_front(data, cache);
+}
+
+static void hash_unlink(struct js_private_data *data, struct js_cache_entry *cache) {
+	struct js_cache_entry **p = &data->hash[cache_hash(data, cache->block)];
+	while (*p != cache) {
+		p = &(*p)->hash_next;
+	}
+	*p = cache->hash_next;
+}
+
+static void hash_insert(struct js_private_data *data, struct js_cache_entry *cache) {
+	struct js_cache_entry **p = &data->hash[cache_hash(data, cache->block)];
+	cache->hash_next = *p;
+	*p = cache;
+}
+
+static void mark_clean(struct js_private_data *data, struct js_cache_entry *cache) {
+	if (cache->dirty) {
+		cache->dirty = 0;
+		data->dirty_count--;
+	}
+}
+
+static void mark_dirty(struct js_private_data *data, struct js_cache_entry *cache) {
+	if (!cache->dirty) {
+		cache->dirty = 1;
+		data->dirty_count++;
+	}
+}
+
+static void drop_cached_block(struct js_private_data *data, struct js_cache_entry *cache) {
+	mark_clean(data, cache);
+	hash_unlink(data, cache);
+	lru_unlink(cache);
+	data->cache_count--;
+	free(cache);
+}
+
+static int dirty_max(io_channel channel) {
+	struct js_private_data *data = get_private_data(channel);
+	int max = data->dirty_size ? data->dirty_size / channel->block_size : data->cache_max / 2;
+	if (max > data->cache_max) {
+		max = data->cache_max;
+	}
+	return max > 0 ? max : 1;
+}
+
+static int compare_cache_block(const void *a, const void *b) {
+	const struct js_cache_entry *ca = *(const struct js_cache_entry **)a;
+	const struct js_cache_entry *cb = *(const struct js_cache_entry **)b;
+	if (ca->block < cb->block) return -1;
+	return ca->block > cb->block;
+}
+
+// Writes all dirty blocks back. Dirty blocks are sorted and contiguous
+// blocks are merged into runs, which are handed to the disk with a single
+// writev per batch. Single block runs are written straight from the cache,
+// longer ones are gathered in a staging buffer of up to WRITEBACK_BATCH_SIZE
+// bytes, which bounds the size of a batch.
+static errcode_t write_dirty_blocks(io_channel channel) {
+	struct js_private_data *data = get_private_data(channel);
+	int block_size = channel->block_size;
+	int batch_blocks = WRITEBACK_BATCH_SIZE / block_size;
+	struct js_cache_entry **dirty = NULL, *cache;
+	struct js_write_segment *segments = NULL;
+	char *staging = NULL;
+	errcode_t ret = 0;
+	int n = 0, i, j, run, used, batch_start, nsegments;
+
+	if (data->dirty_count == 0) {
+		return 0;
+	}
+	if (batch_blocks < 1) {
+		batch_blocks = 1;
+	}
+	dirty = malloc(data->dirty_count * sizeof(*dirty));
+	segments = malloc(data->dirty_count * sizeof(*segments));
+	staging = malloc((data->dirty_count < batch_blocks ? data->dirty_count : batch_blocks) * block_size);
+	if (dirty == NULL || segments == NULL || staging == NULL) {
+		ret = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+	for (cache = data->lru.lru_next; cache != &data->lru; cache = cache->lru_next) {
+		if (cache->dirty) {
+			dirty[n++] = cache;
+		}
+	}
+	qsort(dirty, n, sizeof(*dirty), compare_cache_block);
+
+	i = 0;
+	while (i < n) {
+		batch_start = i;
+		nsegments = 0;
+		used = 0;
+		while (i < n && used < batch_blocks) {
+			run = 1;
+			while (
+				i + run < n &&
+				used + run < batch_blocks &&
+				dirty[i + run]->block == dirty[i]->block + run
+			) {
+				run++;
+			}
+			segments[nsegments].offset = (double)dirty[i]->block * block_size;
+			segments[nsegments].length = run * block_size;
+			if (run == 1) {
+				segments[nsegments].buf = dirty[i]->buf;
+			} else {
+				segments[nsegments].buf = staging + used * block_size;
+				for (j = 0; j < run; j++) {
+					memcpy(staging + (used + j) * block_size, dirty[i + j]->buf, block_size);
+				}
+				used += run;
+			}
+			nsegments++;
+			i += run;
+		}
+		ret = raw_writev(channel, segments, nsegments);
+		if (ret) goto out;
+		for (j = batch_start; j < i; j++) {
+			mark_clean(data, dirty[j]);
+		}
+	}
+out:
+	free(staging);
+	free(segments);
+	free(dirty);
+	return ret;
+}
+
+// Writes all dirty blocks out, and empties the cache if invalidate is set.
+static errcode_t flush_cached_blocks(io_channel channel, int invalidate) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache, *next;
+	errcode_t ret = write_dirty_blocks(channel);
+	if (ret) return ret;
+	if (invalidate) {
+		for (cache = data->lru.lru_next; cache != &data->lru; cache = next) {
+			next = cache->lru_next;
+			drop_cached_block(data, cache);
+		}
+	}
+	return 0;
+}
+
+// Drops the cached copies of [block, block + count), writing the dirty
+// blocks out first if writeback is set.
+static errcode_t invalidate_cached_range(io_channel channel, unsigned long long block, unsigned long long count, int writeback) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache, *next;
+	errcode_t ret;
+	if (data->cache_count == 0) {
+		return 0;
+	}
+	if (writeback && data->dirty_count) {
+		ret = write_dirty_blocks(channel);
+		if (ret) return ret;
+	}
+	if (count <= (unsigned long long)data->cache_count) {
+		for (unsigned long long i = 0; i < count; i++) {
+			cache = find_cached_block(data, block + i);
+			if (cache) {
+				drop_cached_block(data, cache);
+			}
+		}
+		return 0;
+	}
+	for (cache = data->lru.lru_next; cache != &data->lru; cache = next) {
+		next = cache->lru_next;
+		if (cache->block >= block && cache->block - block < count) {
+			drop_cached_block(data, cache);
+		}
+	}
+	return 0;
+}
+
+// Returns a cache entry for block, evicting the least recently used one if
+// the cache is full. The returned entry is clean and its buffer is undefined.
+static errcode_t get_cache_entry(io_channel channel, unsigned long long block, struct js_cache_entry **ret_cache) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache;
+	errcode_t ret;
+	if (data->cache_count >= data->cache_max) {
+		cache = data->lru.lru_prev;
+		if (cache->dirty) {
+			// Write back everything at once rather than one block per eviction.
+			ret = write_dirty_blocks(channel);
+			if (ret) return ret;
+		}
+		hash_unlink(data, cache);
+		lru_unlink(cache);
+	} else {
+		cache = malloc(sizeof(struct js_cache_entry) + channel->block_size);
+		if (cache == NULL) {
+			return EXT2_ET_NO_MEMORY;
+		}
+		cache->dirty = 0;
+		data->cache_count++;
+	}
+	cache->block = block;
+	hash_insert(data, cache);
+	lru_push_front(data, cache);
+	*ret_cache = cache;
+	return 0;
+}
+
+static void free_cache(struct js_private_data *data) {
+	struct js_cache_entry *cache, *next;
+	for (cache = data->lru.lru_next; cache != &data->lru; cache = next) {
+		next = cache->lru_next;
+		free(cache);
+	}
+	data->lru.lru_next = data->lru.lru_prev = &data->lru;
+	data->cache_count = 0;
+	data->dirty_count = 0;
+	free(data->hash);
+	data->hash = NULL;
+	data->cache_max = 0;
+}
+
+// (Re)sizes an empty cache for the current block size and cache_size.
+static errcode_t alloc_cache(io_channel channel) {
+	struct js_private_data *data = get_private_data(channel);
+	unsigned int hash_size = 1;
+	free_cache(data);
+	if (channel->block_size <= 0) {
+		return 0;
+	}
+	data->cache_max = data->cache_size / channel->block_size;
+	if (data->cache_max == 0) {
+		return 0;
+	}
+	while (hash_size < (unsigned int)data->cache_max) {
+		hash_size <<= 1;
+	}
+	data->hash = calloc(hash_size, sizeof(struct js_cache_entry *));
+	if (data->hash == NULL) {
+		data->cache_max = 0;
+		return EXT2_ET_NO_MEMORY;
+	}
+	data->hash_mask = hash_size - 1;
+	return 0;
+}
+
+// Readahead --------------
+
+// Number of blocks in the filesystem, or 0 while it is not known yet (the
+// superblock is read before the filesystem block size is set).
+static unsigned long long channel_blocks_count(io_channel channel) {
+	ext2_filsys fs = channel->app_data;
+	if (fs == NULL || fs->super == NULL || fs->blocksize != channel->block_size) {
+		return 0;
+	}
+	return ext2fs_blocks_count(fs->super);
+}
+
+// Largest prefetch we allow, in blocks: the readahead window must fit in the
+// staging buffer and must not evict its own blocks before they are used.
+static int readahead_max_blocks(io_channel channel) {
+	struct js_private_data *data = get_private_data(channel);
+	int max = data->readahead_size / channel->block_size;
+	if (max > data->cache_max / 2) {
+		max = data->cache_max / 2;
+	}
+	return max;
+}
+
+// Reads the uncached blocks of [block, block + count) into the cache as
+// clean entries, one disk read per run of uncached blocks. Cached blocks
+// (which may be dirty) are left untouched.
+static errcode_t prefetch_blocks(io_channel channel, unsigned long long block, unsigned long long count) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache;
+	int max = readahead_max_blocks(channel);
+	unsigned long long end = block + count;
+	errcode_t ret;
+	int i, j;
+
+	if (max <= 0) {
+		return 0;
+	}
+	if (data->ra_buf == NULL) {
+		data->ra_buf = malloc(data->readahead_size);
+		if (data->ra_buf == NULL) {
+			return EXT2_ET_NO_MEMORY;
+		}
+	}
+	while (block < end) {
+		if (find_cached_block(data, block)) {
+			block++;
+			continue;
+		}
+		for (i = 1; i < max && block + i < end; i++) {
+			if (find_cached_block(data, block + i)) break;
+		}
+		ret = raw_read_blk(channel, block, i, data->ra_buf);
+		if (ret) return ret;
+		for (j = 0; j < i; j++) {
+			ret = get_cache_entry(channel, block + j, &cache);
+			if (ret) return ret;
+			memcpy(cache->buf, data->ra_buf + j * channel->block_size, channel->block_size);
+		}
+		block += i;
+	}
+	return 0;
+}
+
+// Called on a cache miss of a run of count blocks starting at block.
+// Returns the number of blocks that should be read, which is more than count
+// when block continues a sequential stream. The window doubles on every
+// sequential miss and collapses on a random one, like the kernel's.
+static int readahead_blocks(io_channel channel, unsigned long long block, int count) {
+	struct js_private_data *data = get_private_data(channel);
+	unsigned long long blocks_count = channel_blocks_count(channel);
+	int max = readahead_max_blocks(channel);
+	int ra;
+
+	if (block != data->ra_next || max <= 0 || block >= blocks_count) {
+		data->ra_window = 0;
+		data->ra_next = block + count;
+		return count;
+	}
+	data->ra_window = data->ra_window ? data->ra_window * 2 : READAHEAD_MIN_BLOCKS;
+	if (data->ra_window > max) {
+		data->ra_window = max;
+	}
+	ra = data->ra_window;
+	if (ra < count) {
+		ra = count;
+	}
+	if (block + ra > blocks_count) {
+		ra = blocks_count - block;
+	}
+	data->ra_next = block + ra;
+	return ra;
+}
+// ------------------------
+
+// Dentry cache -----------
+// Results of the (directory inode, name) lookups done while resolving paths,
+// see lookup_path. Names that don't exist are cached too. Directories are only
+// modified through glue.c, which invalidates the entries it changes.
+
+static unsigned int dentry_hash(ext2_ino_t dir, const char *name, int len) {
+	unsigned int hash = 2166136261u ^ dir;	// FNV-1a
+	int i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static struct js_dentry *find_dentry(struct js_private_data *data, ext2_ino_t dir, const char *name, int len, unsigned int hash) {
+	struct js_dentry *dentry;
+	if (data->dcache_hash == NULL) {
+		return NULL;
+	}
+	for (dentry = data->dcache_hash[hash & data->dcache_mask]; dentry != NULL; dentry = dentry->hash_next) {
+		if (
+			dentry->hash == hash &&
+			dentry->dir == dir &&
+			dentry->name_len == len &&
+			memcmp(dentry->name, name, len) == 0
+		) {
+			return dentry;
+		}
+	}
+	return NULL;
+}
+
+static void dentry_lru_unlink(struct js_dentry *dentry) {
+	dentry->lru_prev->lru_next = dentry->lru_next;
+	dentry->lru_next->lru_prev = dentry->lru_prev;
+}
+
+static void dentry_lru_push_front(struct js_private_data *data, struct js_dentry *dentry) {
+	dentry->lru_prev = &data->dcache_lru;
+	dentry->lru_next = data->dcache_lru.lru_next;
+	dentry->lru_next->lru_prev = dentry;
+	data->dcache_lru.lru_next = dentry;
+}
+
+static void drop_dentry(struct js_private_data *data, struct js_dentry *dentry) {
+	struct js_dentry **prev = &data->dcache_hash[dentry->hash & data->dcache_mask];
+	while (*prev != dentry) {
+		prev = &(*prev)->hash_next;
+	}
+	*prev = dentry->hash_next;
+	dentry_lru_unlink(dentry);
+	data->dcache_count--;
+	free(dentry);
+}
+
+static void free_dcache(struct js_private_data *data) {
+	struct js_dentry *dentry, *next;
+	for (dentry = data->dcache_lru.lru_next; dentry != &data->dcache_lru; dentry = next) {
+		next = dentry->lru_next;
+		free(dentry);
+	}
+	data->dcache_lru.lru_next = data->dcache_lru.lru_prev = &data->dcache_lru;
+	data->dcache_count = 0;
+	free(data->dcache_hash);
+	data->dcache_hash = NULL;
+}
+
+// Returns 1 and sets `ino` (0 if the name doesn't exist) and `is_link` when
+// the lookup is cached, 0 otherwise.
+int js_dcache_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino, int *is_link) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_dentry *dentry = find_dentry(data, dir, name, len, dentry_hash(dir, name, len));
+	if (dentry == NULL) {
+		return 0;
+	}
+	dentry_lru_unlink(dentry);
+	dentry_lru_push_front(data, dentry);
+	*ino = dentry->ino;
+	*is_link = dentry->is_link;
+	return 1;
+}
+
+void js_dcache_insert(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t ino, int is_link) {
+	struct js_private_data *data = get_private_data(fs->io);
+	unsigned int hash = dentry_hash(dir, name, len);
+	unsigned int hash_size = 1;
+	struct js_dentry *dentry;
+	if (data->dcache_max == 0 || len > EXT2_NAME_LEN) {
+		return;
+	}
+	if (data->dcache_hash == NULL) {
+		while (hash_size < (unsigned int)data->dcache_max) {
+			hash_size <<= 1;
+		}
+		data->dcache_hash = calloc(hash_size, sizeof(struct js_dentry *));
+		if (data->dcache_hash == NULL) {
+			return;
+		}
+		data->dcache_mask = hash_size - 1;
+	}
+	dentry = find_dentry(data, dir, name, len, hash);
+	if (dentry != NULL) {
+		dentry_lru_unlink(dentry);
+	} else {
+		if (data->dcache_count >= data->dcache_max) {
+			drop_dentry(data, data->dcache_lru.lru_prev);
+		}
+		dentry = malloc(sizeof(struct js_dentry) + len);
+		if (dentry == NULL) {
+			return;
+		}
+		dentry->dir = dir;
+		dentry->hash = hash;
+		dentry->name_len = len;
+		memcpy(dentry->name, name, len);
+		dentry->hash_next = data->dcache_hash[hash & data->dcache_mask];
+		data->dcache_hash[hash & data->dcache_mask] = dentry;
+		data->dcache_count++;
+	}
+	dentry->ino = ino;
+	dentry->is_link = is_link;
+	dentry_lru_push_front(data, dentry);
+}
+
+// Called after `name` was added to or removed from `dir`.
+void js_dcache_invalidate(ext2_filsys fs, ext2_ino_t dir, const char *name, int len) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_dentry *dentry = find_dentry(data, dir, name, len, dentry_hash(dir, name, len));
+	if (dentry != NULL) {
+		drop_dentry(data, dentry);
+	}
+}
+
+// Called after the directory `dir` was removed.
+void js_dcache_invalidate_dir(ext2_filsys fs, ext2_ino_t dir) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_dentry *dentry, *next;
+	for (dentry = data->dcache_lru.lru_next; dentry != &data->dcache_lru; dentry = next) {
+		next = dentry->lru_next;
+		if (dentry->dir == dir) {
+			drop_dentry(data, dentry);
+		}
+	}
+}
+// ------------------------
+
+// Inode cache ------------
+// Write-back cache of the inodes glue.c reads and updates itself: times,
+// mode, owner, link counts. Consecutive updates of an inode (the atime of
+// every read, the ctime and mtime of every write...) cost a single
+// ext2fs_write_inode_full when the inode is evicted, its file is closed or the
+// filesystem is unmounted. libext2fs doesn't know about this cache: glue.c
+// flushes an inode before passing it to a library function that writes it,
+// and keeps file->inode, the copy of an open file, in sync with it.
+
+static struct js_inode_entry *find_cached_inode(struct js_private_data *data, ext2_ino_t ino) {
+	struct js_inode_entry *entry;
+	if (data->icache_hash == NULL) {
+		return NULL;
+	}
+	for (entry = data->icache_hash[ino & data->icache_mask]; entry != NULL; entry = entry->hash_next) {
+		if (entry->ino == ino) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void inode_lru_unlink(struct js_inode_entry *entry) {
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void inode_lru_push_front(struct js_private_data *data, struct js_inode_entry *entry) {
+	entry->lru_prev = &data->icache_lru;
+	entry->lru_next = data->icache_lru.lru_next;
+	entry->lru_next->lru_prev = entry;
+	data->icache_lru.lru_next = entry;
+}
+
+static void drop_cached_inode(struct js_private_data *data, struct js_inode_entry *entry) {
+	struct js_inode_entry **prev = &data->icache_hash[entry->ino & data->icache_mask];
+	while (*prev != entry) {
+		prev = &(*prev)->hash_next;
+	}
+	*prev = entry->hash_next;
+	inode_lru_unlink(entry);
+	data->icache_count--;
+	free(entry);
+}
+
+static errcode_t write_back_inode(ext2_filsys fs, struct js_inode_entry *entry) {
+	errcode_t ret;
+	if (!entry->dirty) {
+		return 0;
+	}
+	ret = ext2fs_write_inode_full(fs, entry->ino, (struct ext2_inode *)&entry->inode, sizeof(entry->inode));
+	if (ret) return ret;
+	entry->dirty = 0;
+	return 0;
+}
+
+// Drops every entry, dirty ones included.
+static void free_icache(struct js_private_data *data) {
+	struct js_inode_entry *entry, *next;
+	for (entry = data->icache_lru.lru_next; entry != &data->icache_lru; entry = next) {
+		next = entry->lru_next;
+		free(entry);
+	}
+	data->icache_lru.lru_next = data->icache_lru.lru_prev = &data->icache_lru;
+	data->icache_count = 0;
+	free(data->icache_hash);
+	data->icache_hash = NULL;
+}
+
+// Finds or reads `ino`, evicting (and writing back) the least recently used
+// inode if the cache is full.
+static errcode_t get_cached_inode(ext2_filsys fs, ext2_ino_t ino, struct js_inode_entry **ret_entry) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_inode_entry *entry = find_cached_inode(data, ino);
+	unsigned int hash_size = 1;
+	errcode_t ret;
+	if (entry != NULL) {
+		inode_lru_unlink(entry);
+		inode_lru_push_front(data, entry);
+		*ret_entry = entry;
+		return 0;
+	}
+	if (data->icache_hash == NULL) {
+		while (hash_size < (unsigned int)data->icache_max) {
+			hash_size <<= 1;
+		}
+		data->icache_hash = calloc(hash_size, sizeof(struct js_inode_entry *));
+		if (data->icache_hash == NULL) {
+			return EXT2_ET_NO_MEMORY;
+		}
+		data->icache_mask = hash_size - 1;
+	}
+	if (data->icache_count >= data->icache_max) {
+		entry = data->icache_lru.lru_prev;
+		ret = write_back_inode(fs, entry);
+		if (ret) return ret;
+		drop_cached_inode(data, entry);
+	}
+	entry = malloc(sizeof(struct js_inode_entry));
+	if (entry == NULL) {
+		return EXT2_ET_NO_MEMORY;
+	}
+	memset(&entry->inode, 0, sizeof(entry->inode));
+	ret = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *)&entry->inode, sizeof(entry->inode));
+	if (ret) {
+		free(entry);
+		return ret;
+	}
+	entry->ino = ino;
+	entry->dirty = 0;
+	entry->hash_next = data->icache_hash[ino & data->icache_mask];
+	data->icache_hash[ino & data->icache_mask] = entry;
+	inode_lru_push_front(data, entry);
+	data->icache_count++;
+	*ret_entry = entry;
+	return 0;
+}
+
+// Same as ext2fs_read_inode_full, `bufsize` is at most
+// sizeof(struct ext2_inode_large).
+errcode_t js_icache_read(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize) {
+	struct js_inode_entry *entry;
+	errcode_t ret;
+	if (get_private_data(fs->io)->icache_max == 0) {
+		return ext2fs_read_inode_full(fs, ino, inode, bufsize);
+	}
+	ret = get_cached_inode(fs, ino, &entry);
+	if (ret) return ret;
+	memcpy(inode, &entry->inode, bufsize);
+	return 0;
+}
+
+// Same as ext2fs_write_inode_full, but the inode is only written back later.
+errcode_t js_icache_write(ext2_filsys fs, ext2_ino_t ino, const struct ext2_inode *inode, int bufsize) {
+	struct js_inode_entry *entry;
+	errcode_t ret;
+	if (get_private_data(fs->io)->icache_max == 0) {
+		return ext2fs_write_inode_full(fs, ino, (struct ext2_inode *)inode, bufsize);
+	}
+	ret = get_cached_inode(fs, ino, &entry);
+	if (ret) return ret;
+	memcpy(&entry->inode, inode, bufsize);
+	entry->dirty = 1;
+	return 0;
+}
+
+// Updates the cached copy of `ino`, if any, after libext2fs has written it.
+void js_icache_refresh(ext2_filsys fs, ext2_ino_t ino, const struct ext2_inode *inode, int bufsize) {
+	struct js_inode_entry *entry = find_cached_inode(get_private_data(fs->io), ino);
+	if (entry != NULL) {
+		memcpy(&entry->inode, inode, bufsize);
+	}
+}
+
+// Writes `ino` back if it is dirty and forgets it, so that the next read sees
+// what libext2fs writes in the meantime.
+errcode_t js_icache_flush(ext2_filsys fs, ext2_ino_t ino) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_inode_entry *entry = find_cached_inode(data, ino);
+	errcode_t ret;
+	if (entry == NULL) {
+		return 0;
+	}
+	ret = write_back_inode(fs, entry);
+	if (ret) return ret;
+	drop_cached_inode(data, entry);
+	return 0;
+}
+
+errcode_t js_icache_flush_all(ext2_filsys fs) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_inode_entry *entry;
+	errcode_t ret;
+	while (data->icache_lru.lru_prev != &data->icache_lru) {
+		entry = data->icache_lru.lru_prev;
+		ret = write_back_inode(fs, entry);
+		if (ret) return ret;
+		drop_cached_inode(data, entry);
+	}
+	return 0;
+}
+// ------------------------
+
+// Progress ---------------
+// Long loops call js_progress_update on every step. At most every
+// yield_interval ms it calls the js progress callback and yields to the event
+// loop, so that a trim of a large filesystem doesn't block it. Modeled after
+// the ext2fs_numeric_progress_* functions of lib/ext2fs/progress.c.
+
+void js_progress_init(struct js_progress *progress, ext2_filsys fs, int callback_id, double max) {
+	progress->channel = fs->io;
+	progress->callback_id = callback_id;
+	progress->max = max;
+	progress->done = 0;
+	progress->last_yield = emscripten_get_now();
+	progress->calls = 0;
+}
+
+errcode_t js_progress_update(struct js_progress *progress, double done) {
+	struct js_private_data *data = get_private_data(progress->channel);
+	double now;
+	progress->done = done;
+	if (data->yield_interval == 0 || ++progress->calls < PROGRESS_CHECK_CALLS) {
+		return 0;
+	}
+	progress->calls = 0;
+	now = emscripten_get_now();
+	if (now - progress->last_yield < data->yield_interval) {
+		return 0;
+	}
+	errcode_t ret = yield_to_js(progress->callback_id, progress->done, progress->max);
+	progress->last_yield = emscripten_get_now();
+	return ret;
+}
+
+// Reports completion to the callback, if any.
+errcode_t js_progress_close(struct js_progress *progress) {
+	progress->done = progress->max;
+	if (progress->callback_id == 0) {
+		return 0;
+	}
+	return report_progress(progress->callback_id, progress->done, progress->max);
+}
+
+// Every read on `channel` advances `progress` until this is called again
+// with NULL, for library calls that we can't instrument.
+void js_set_channel_progress(io_channel channel, struct js_progress *progress) {
+	get_private_data(channel)->progress = progress;
 }
 
 static errcode_t js_open_entry(const char *disk_id_str, int flags, io_channel *channel) {
 	io_channel io = NULL;
+	struct js_private_data *data = NULL;
+	int i;
 	errcode_t ret = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
 	if (ret) {
 		return ret;
 	}
 	memset(io, 0, sizeof(struct struct_io_channel));
+	ret = ext2fs_get_mem(sizeof(struct js_private_data), &data);
+	if (ret) {
+		ext2fs_free_mem(&io);
+		return ret;
+	}
+	memset(data, 0, sizeof(struct js_private_data));
+	sscanf(disk_id_str, "%d", &data->disk_id);
+	data->capabilities = disk_capabilities(data->disk_id);
+	data->read_only = !(flags & IO_FLAG_RW);
+	data->cache_size = CACHE_DEFAULT_SIZE;
+	data->readahead_size = READAHEAD_DEFAULT_SIZE;
+	data->yield_interval = YIELD_DEFAULT_INTERVAL;
+	data->dcache_max = DCACHE_DEFAULT_SIZE;
+	data->icache_max = ICACHE_DEFAULT_SIZE;
+	data->lru.lru_next = data->lru.lru_prev = &data->lru;
+	data->dcache_lru.lru_next = data->dcache_lru.lru_prev = &data->dcache_lru;
+	data->icache_lru.lru_next = data->icache_lru.lru_prev = &data->icache_lru;
+	data->stats = &data->own_stats;
+	for (i = 0; i < IO_STAT_TYPES; i++) {
+		data->last_end[i] = -1;
+	}
+	data->io_stats.num_fields = 2;
 	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
 	io->manager = get_js_io_manager();
-	sscanf(disk_id_str, "%d", (int*)&io->private_data);
+	io->refcount = 1;
+	io->private_data = data;
 	*channel = io;
 	return 0;
 }
 
 static errcode_t js_close_entry(io_channel channel) {
-	return ext2fs_free_mem(&channel);
+	struct js_private_data *data = get_private_data(channel);
+	if (--channel->refcount > 0) {
+		return 0;
+	}
+	errcode_t ret = flush_cached_blocks(channel, 0);
+	free_cache(data);
+	free_dcache(data);
+	// Dirty inodes were written back by node_ext2fs_umount.
+	free_icache(data);
+	free(data->ra_buf);
+	free(data->metadata);
+	ext2fs_free_mem(&data);
+	ext2fs_free_mem(&channel);
+	return ret;
 }
 
 static errcode_t set_blksize(io_channel channel, int blksize) {
+	errcode_t ret;
+	if (channel->block_size == blksize) {
+		return 0;
+	}
+	// Cached blocks are indexed by block number, they can't survive this.
+	ret = flush_cached_blocks(channel, 1);
+	if (ret) return ret;
 	channel->block_size = blksize;
+	return alloc_cache(channel);
+}
+
+static errcode_t js_set_option_entry(io_channel channel, const char *option, const char *arg) {
+	struct js_private_data *data = get_private_data(channel);
+	char *end;
+	errcode_t ret;
+	if (strcmp(option, "cache_size") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long cache_size = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		ret = flush_cached_blocks(channel, 1);
+		if (ret) return ret;
+		data->cache_size = cache_size;
+		return alloc_cache(channel);
+	}
+	if (strcmp(option, "readahead") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long readahead_size = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		free(data->ra_buf);
+		data->ra_buf = NULL;
+		data->ra_window = 0;
+		data->readahead_size = readahead_size;
+		return 0;
+	}
+	if (strcmp(option, "stats") == 0) {
+		// Address of a zeroed struct js_io_stats owned by js, which can
+		// then read it at any time, even after umount.
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long stats = strtoul(arg, &end, 0);
+		if (*end || stats == 0) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		data->stats = (struct js_io_stats *)stats;
+		return 0;
+	}
+	if (strcmp(option, "discard_granularity") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long discard_granularity = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		data->discard_granularity = discard_granularity;
+		return 0;
+	}
+	if (strcmp(option, "yield_interval") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long yield_interval = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		data->yield_interval = yield_interval;
+		return 0;
+	}
+	if (strcmp(option, "dentry_cache") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long dcache_max = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		free_dcache(data);
+		data->dcache_max = dcache_max;
+		return 0;
+	}
+	if (strcmp(option, "inode_cache") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long icache_max = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		if (data->icache_count > 0) {
+			ret = js_icache_flush_all(channel->app_data);
+			if (ret) return ret;
+		}
+		free_icache(data);
+		data->icache_max = icache_max;
+		return 0;
+	}
+	if (strcmp(option, "dirty_size") == 0) {
+		if (arg == NULL) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		unsigned long dirty_size = strtoul(arg, &end, 0);
+		if (*end) {
+			return EXT2_ET_INVALID_ARGUMENT;
+		}
+		data->dirty_size = dirty_size;
+		if (data->dirty_count >= dirty_max(channel)) {
+			return write_dirty_blocks(channel);
+		}
+		return 0;
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t js_read_blk64_entry(io_channel channel, unsigned long long block, int count, void *buf) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache;
+	char *cp = buf;
+	errcode_t ret;
+	int i, ra;
+
+	if (data->progress) {
+		ret = js_progress_update(data->progress, data->progress->done + 1);
+		if (ret) return ret;
+	}
+	// Odd-sized or large reads go straight to the disk, once the dirty blocks
+	// they cover have been written out.
+	if (data->cache_max == 0 || count < 0 || count > CACHE_DIRECT_SIZE) {
+		if (data->dirty_count) {
+			ret = invalidate_cached_range(channel, block, count_to_blocks(channel, count), 1);
+			if (ret) return ret;
+		}
+		return raw_read_blk(channel, block, count, buf);
+	}
+	while (count > 0) {
+		cache = find_cached_block(data, block);
+		if (cache) {
+			data->stats->cache_hits++;
+			memcpy(cp, cache->buf, channel->block_size);
+			touch_cached_block(data, cache);
+			count--;
+			block++;
+			cp += channel->block_size;
+			continue;
+		}
+		// Read the whole run of uncached blocks in one request.
+		for (i = 1; i < count; i++) {
+			if (find_cached_block(data, block + i)) break;
+		}
+		data->stats->cache_misses += i;
+		ra = readahead_blocks(channel, block, i);
+		if (ra > i) {
+			// The next iterations are served from the cache. If the
+			// prefetch failed part way, the blocks it did not get miss
+			// again and are read without readahead.
+			prefetch_blocks(channel, block, ra);
+			continue;
+		}
+		ret = raw_read_blk(channel, block, i, cp);
+		if (ret) return ret;
+		for (; i > 0; i--) {
+			ret = get_cache_entry(channel, block, &cache);
+			if (ret) return ret;
+			memcpy(cache->buf, cp, channel->block_size);
+			count--;
+			block++;
+			cp += channel->block_size;
+		}
+	}
+	return 0;
+}
+
+static errcode_t js_write_blk64_entry(io_channel channel, unsigned long long block, int count, const void *buf) {
+	struct js_private_data *data = get_private_data(channel);
+	struct js_cache_entry *cache;
+	const char *cp = buf;
+	errcode_t ret;
+
+	if (data->read_only) {
+		return EROFS;
+	}
+	if (data->cache_max == 0 || count < 0 || count > CACHE_DIRECT_SIZE) {
+		// Cached copies are superseded by this write, but a partial block
+		// write must not lose the rest of a dirty block.
+		ret = invalidate_cached_range(channel, block, count_to_blocks(channel, count), count < 0);
+		if (ret) return ret;
+		return raw_write_blk(channel, block, count, buf);
+	}
+	while (count > 0) {
+		cache = find_cached_block(data, block);
+		if (cache) {
+			touch_cached_block(data, cache);
+		} else {
+			ret = get_cache_entry(channel, block, &cache);
+			if (ret) return ret;
+		}
+		memcpy(cache->buf, cp, channel->block_size);
+		mark_dirty(data, cache);
+		count--;
+		block++;
+		cp += channel->block_size;
+	}
+	if (data->dirty_count >= dirty_max(channel)) {
+		return write_dirty_blocks(channel);
+	}
 	return 0;
 }
 
 static errcode_t js_read_blk_entry(io_channel channel, unsigned long block, int count, void *data) {
-	int disk_id = get_disk_id(channel);
-	return blk_read(disk_id, channel->block_size, block, count, data);
+	return js_read_blk64_entry(channel, block, count, data);
 }
 
 static errcode_t js_write_blk_entry(io_channel channel, unsigned long block, int count, const void *data) {
-	int disk_id = get_disk_id(channel);
-	return blk_write(disk_id, channel->block_size, block, count, data);
+	return js_write_blk64_entry(channel, block, count, data);
 }
 
 static errcode_t js_flush_entry(io_channel channel) {
-	int disk_id = get_disk_id(channel);
-	return flush(disk_id);
+	if (get_private_data(channel)->read_only) {
+		return 0;
+	}
+	errcode_t ret = flush_cached_blocks(channel, 0);
+	if (ret) return ret;
+	return raw_flush(channel);
 }
 
-static errcode_t js_read_blk64_entry(io_channel channel, unsigned long long block, int count, void *data) {
-	return js_read_blk_entry(channel, block, count, data);
+static errcode_t js_discard_entry(io_channel channel, unsigned long long block, unsigned long long count) {
+	if (get_private_data(channel)->read_only) {
+		return EROFS;
+	}
+	// Discarded blocks must not be resurrected by a later write back.
+	errcode_t ret = invalidate_cached_range(channel, block, count, 0);
+	if (ret) return ret;
+	return raw_discard(channel, (double)block * channel->block_size, (double)count * channel->block_size);
 }
 
-static errcode_t js_write_blk64_entry(io_channel channel, unsigned long long block, int count, const void *data) {
-	return js_write_blk_entry(channel, block, count, data);
+// Queues [block, block + count) for discard. The range is shrunk to
+// discard_granularity boundaries (rounded up to whole blocks) and dropped if
+// nothing is left. Ranges are never stretched, that would discard blocks that
+// are still in use. The batch is submitted when it is full.
+static errcode_t js_discard_batch_add(struct js_discard_batch *batch, unsigned long long block, unsigned long long count) {
+	io_channel channel = batch->channel;
+	struct js_private_data *data = get_private_data(channel);
+	struct js_discard_range *range;
+	unsigned long long granularity, end;
+	double offset;
+	errcode_t ret;
+
+	granularity = (data->discard_granularity + channel->block_size - 1) / channel->block_size;
+	if (granularity > 1) {
+		end = (block + count) / granularity * granularity;
+		block = (block + granularity - 1) / granularity * granularity;
+		if (end <= block) {
+			return 0;
+		}
+		count = end - block;
+	}
+	// Discarded blocks must not be resurrected by a later write back.
+	ret = invalidate_cached_range(channel, block, count, 0);
+	if (ret) return ret;
+	offset = (double)block * channel->block_size;
+	batch->discarded += (double)count * channel->block_size;
+	if (batch->count == DISCARD_BATCH) {
+		ret = js_discard_batch_submit(batch);
+		if (ret) return ret;
+	}
+	range = &batch->ranges[batch->count++];
+	range->offset = offset;
+	range->length = (double)count * channel->block_size;
+	return 0;
 }
 
-static errcode_t js_discard_entry(io_channel channel, unsigned long long block, unsigned long long count) {
-	int disk_id = get_disk_id(channel);
-	return discard(disk_id, channel->block_size, block, count);
+// Hands the queued ranges to the disk in a single discard_ranges call.
+static errcode_t js_discard_batch_submit(struct js_discard_batch *batch) {
+	int count = batch->count;
+	if (count == 0) {
+		return 0;
+	}
+	batch->count = 0;
+	dbg_pf("%s: discarding %d ranges\n", __func__, count);
+	return raw_discard_ranges(batch->channel, batch->ranges, count);
 }
 
+// Explicit readahead hint, the blocks are only prefetched if they fit in the
+// cache.
 static errcode_t js_cache_readahead_entry(io_channel channel, unsigned long long block, unsigned long long count) {
-	return 0;
+	struct js_private_data *data = get_private_data(channel);
+	unsigned long long max = data->cache_max / 2;
+	if (count > max) {
+		count = max;
+	}
+	return prefetch_blocks(channel, block, count);
 }
 
+// Shared by all channels, it is never written to.
+static const char zero_buf[ZEROOUT_CHUNK_SIZE];
+
+// Zeroes the range with the disk's zeroOut when it has one. Otherwise the
+// range is written from a single fixed zero buffer, ZEROOUT_BATCH chunks per
+// writev, and discarded, so the heap does not grow with the size of the
+// range.
 static errcode_t js_zeroout_entry(io_channel channel, unsigned long long block, unsigned long long count) {
-	int disk_id = get_disk_id(channel);
-	unsigned long long size = (count < 0) ? -count : count * channel->block_size;
-	char *data = malloc(size);
-	memset(data, 0, size);
-	errcode_t ret = blk_write(disk_id, channel->block_size, block, count, data);
-	free(data);
+	struct js_private_data *data = get_private_data(channel);
+	struct js_write_segment segments[ZEROOUT_BATCH];
+	double offset = (double)block * channel->block_size;
+	double end = offset + (double)count * channel->block_size;
+	errcode_t ret;
+	int n;
+
+	if (data->read_only) {
+		return EROFS;
+	}
+	ret = invalidate_cached_range(channel, block, count, 0);
 	if (ret) return ret;
-	return discard(disk_id, channel->block_size, block, count);
+	// Disk zeroOut requests are accounted for in ops[IO_STAT_ZEROOUT], the
+	// fallback as writes and a discard, plus one zeroout_writes.
+	if (data->capabilities & DISK_CAP_ZEROOUT) {
+		dbg_pf("%s: zeroOut %llu blocks at %llu\n", __func__, count, block);
+		return raw_zero_out(channel, offset, end - offset);
+	}
+	dbg_pf("%s: writing zeroes to %llu blocks at %llu\n", __func__, count, block);
+	data->stats->zeroout_writes++;
+	while (offset < end) {
+		for (n = 0; n < ZEROOUT_BATCH && offset < end; n++) {
+			segments[n].offset = offset;
+			segments[n].length = end - offset < ZEROOUT_CHUNK_SIZE ? end - offset : ZEROOUT_CHUNK_SIZE;
+			segments[n].buf = zero_buf;
+			offset += segments[n].length;
+		}
+		ret = raw_writev(channel, segments, n);
+		if (ret) return ret;
+	}
+	return raw_discard(channel, (double)block * channel->block_size, (double)count * channel->block_size);
+}
+
+static int compare_extent(const void *a, const void *b) {
+	const struct js_extent *x = a, *y = b;
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// Builds the metadata map used by the stats from the block group layout:
+// superblocks, group descriptors (and their reserved blocks), bitmaps and
+// inode tables.
+errcode_t js_load_metadata_map(ext2_filsys fs) {
+	struct js_private_data *data = get_private_data(fs->io);
+	struct js_extent *extents, *e;
+	blk64_t super_blk, old_desc_blk, new_desc_blk;
+	blk_t used_blks;
+	dgrp_t group;
+	int n = 0, i;
+	errcode_t ret;
+
+	extents = malloc(sizeof(*extents) * fs->group_desc_count * 6);
+	if (extents == NULL) {
+		return EXT2_ET_NO_MEMORY;
+	}
+	for (group = 0; group < fs->group_desc_count; group++) {
+		ret = ext2fs_super_and_bgd_loc2(fs, group, &super_blk, &old_desc_blk, &new_desc_blk, &used_blks);
+		if (ret) {
+			free(extents);
+			return ret;
+		}
+		if (super_blk || group == 0) {
+			extents[n++] = (struct js_extent){ super_blk, 1 };
+			used_blks--;
+		}
+		if (new_desc_blk) {
+			extents[n++] = (struct js_extent){ new_desc_blk, 1 };
+			used_blks--;
+		}
+		if (old_desc_blk && used_blks) {
+			extents[n++] = (struct js_extent){ old_desc_blk, used_blks };
+		}
+		extents[n++] = (struct js_extent){ ext2fs_block_bitmap_loc(fs, group), 1 };
+		extents[n++] = (struct js_extent){ ext2fs_inode_bitmap_loc(fs, group), 1 };
+		extents[n++] = (struct js_extent){ ext2fs_inode_table_loc(fs, group), fs->inode_blocks_per_group };
+	}
+	qsort(extents, n, sizeof(*extents), compare_extent);
+	// Merge overlapping and adjacent extents, flex_bg packs them together.
+	for (i = 1, e = extents; i < n; i++) {
+		if (extents[i].block <= e->block + e->count) {
+			if (extents[i].block + extents[i].count > e->block + e->count) {
+				e->count = extents[i].block + extents[i].count - e->block;
+			}
+		} else {
+			*++e = extents[i];
+		}
+	}
+	free(data->metadata);
+	data->metadata = extents;
+	data->metadata_count = n ? e - extents + 1 : 0;
+	return 0;
+}
+
+static errcode_t js_get_stats_entry(io_channel channel, io_stats *stats) {
+	if (stats) {
+		*stats = &get_private_data(channel)->io_stats;
+	}
+	return 0;
 }
 
 struct struct_io_manager js_io_manager;
@@ -1486,6 +3479,8 @@ io_manager get_js_io_manager() {
 	js_io_manager.read_blk				 =	js_read_blk_entry;
 	js_io_manager.write_blk				=	js_write_blk_entry;
 	js_io_manager.flush						=	js_flush_entry;
+	js_io_manager.set_option			 =	js_set_option_entry;
+	js_io_manager.get_stats				=	js_get_stats_entry;
 	js_io_manager.read_blk64			 =	js_read_blk64_entry;
 	js_io_manager.write_blk64			=	js_write_blk64_entry;
 	js_io_manager.discard					=	js_discard_entry;
@@ -1,4 +1,74 @@
 io_manager get_js_io_manager();
+
+// Operations of node_ext2fs_batch
+#define BATCH_STAT	0
+#define BATCH_LSTAT	1
+#define BATCH_READLINK	2
+
+// Inode fields as returned to js, all doubles so that they can be read
+// through HEAPF64.
+struct node_ext2fs_stat {
+	double ino;
+	double mode;
+	double nlink;
+	double uid;
+	double gid;
+	double size;
+	double blocks;
+	double blksize;
+	double atime;
+	double mtime;
+	double ctime;
+	double atime_nsec;
+	double mtime_nsec;
+	double ctime_nsec;
+};
+
+struct node_ext2fs_batch_op {
+	int op;
+	int path;	// offset of the NUL terminated path in the paths buffer
+};
+
+struct node_ext2fs_batch_result {
+	double error;	// 0 or a negative errno
+	double link;	// index of the readlink target in the js array
+	struct node_ext2fs_stat stat;
+};
+
+// Record of the buffer node_ext2fs_readdir returns, followed by the name.
+struct node_ext2fs_dirent {
+	__u32	ino;
+	__u8	file_type;	// EXT2_FT_*
+	__u8	name_len;
+} __attribute__((packed));
+
+errcode_t js_load_metadata_map(ext2_filsys fs);
+int js_dcache_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t *ino, int *is_link);
+void js_dcache_insert(ext2_filsys fs, ext2_ino_t dir, const char *name, int len, ext2_ino_t ino, int is_link);
+void js_dcache_invalidate(ext2_filsys fs, ext2_ino_t dir, const char *name, int len);
+void js_dcache_invalidate_dir(ext2_filsys fs, ext2_ino_t dir);
+errcode_t js_icache_read(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, int bufsize);
+errcode_t js_icache_write(ext2_filsys fs, ext2_ino_t ino, const struct ext2_inode *inode, int bufsize);
+void js_icache_refresh(ext2_filsys fs, ext2_ino_t ino, const struct ext2_inode *inode, int bufsize);
+errcode_t js_icache_flush(ext2_filsys fs, ext2_ino_t ino);
+errcode_t js_icache_flush_all(ext2_filsys fs);
+
+// Progress of a long operation, see js_progress_update.
+struct js_progress {
+	io_channel	channel;
+	int		callback_id;	// js function called with (done, max), 0 for none
+	double		max;
+	double		done;
+	double		last_yield;	// emscripten_get_now() of the last yield
+	int		calls;	// updates since the clock was last read
+};
+void js_progress_init(struct js_progress *progress, ext2_filsys fs, int callback_id, double max);
+errcode_t js_progress_update(struct js_progress *progress, double done);
+errcode_t js_progress_close(struct js_progress *progress);
+void js_set_channel_progress(io_channel channel, struct js_progress *progress);
+struct js_discard_batch;
+static errcode_t js_discard_batch_add(struct js_discard_batch *batch, unsigned long long block, unsigned long long count);
+static errcode_t js_discard_batch_submit(struct js_discard_batch *batch);
 static int unlink_file_by_name(ext2_filsys fs, const char *path);
 static int update_ctime(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode_large *pinode);
 static int update_mtime(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode_large *pinode);
@@ -55,3 +55,4 @@ Module.getBuffer = getBuffer;
 
 // from lib/wasi.js
 Module.EIO = 29;
+Module.ECANCELED = 11;
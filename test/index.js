@@ -1,14 +1,15 @@
 'use strict';
-/*global it describe*/
+/*global it describe WebAssembly BigInt*/
 
 const assert = require('assert');
 const Bluebird = require('bluebird');
 const filedisk = require('file-disk');
-const { createReadStream } = require('fs');
+const { createReadStream, promises: { readFile } } = require('fs');
 const pathModule = require('path');
 const stream = require('stream');
 
 const ext2fs = require('..');
+const { DiskWrapper } = require('../lib/disk');
 
 // Each image contains 5 files named 1, 2, 3, 4, 5 and containing
 // 'one\n', 'two\n', 'three\n', 'four\n', 'five\n' respectively.
@@ -832,6 +833,716 @@ describe('ext2fs', () => {
 		});
 	});
 
+	describe('read only mount', () => {
+		testOnAllDisks(async (disk) => {
+			let writes = 0;
+			let flushes = 0;
+			const write = disk.write.bind(disk);
+			const flush = disk.flush.bind(disk);
+			disk.write = async (...args) => {
+				writes += 1;
+				return await write(...args);
+			};
+			disk.flush = async () => {
+				flushes += 1;
+				return await flush();
+			};
+			const report = await ext2fs.withMountedDisk(disk, 0, { readOnly: true }, async (fs) => {
+				const { promises } = fs;
+				assert.strictEqual(promises.readOnly, true);
+				const { atime } = await promises.stat('/1');
+				assert.strictEqual(await promises.readFile('/1', 'utf8'), 'one\n');
+				assert.deepStrictEqual((await promises.stat('/1')).atime, atime);
+				const erofs = (err) => err.code === 'EROFS';
+				await assert.rejects(promises.writeFile('/new', 'new\n'), erofs);
+				await assert.rejects(promises.writeFile('/1', 'one\n'), erofs);
+				await assert.rejects(promises.mkdir('/dir'), erofs);
+				await assert.rejects(promises.unlink('/1'), erofs);
+				await assert.rejects(promises.rename('/1', '/one'), erofs);
+				await assert.rejects(promises.symlink('/1', '/link'), erofs);
+				await assert.rejects(promises.chmod('/1', 0o777), erofs);
+				await assert.rejects(promises.chown('/1', 1, 2), erofs);
+				await assert.rejects(promises.link('/1', '/hardlink'), erofs);
+				await assert.rejects(promises.access('/1', fs.constants.W_OK), erofs);
+				await promises.access('/1', fs.constants.R_OK);
+				await assert.rejects(promises.trim(), erofs);
+				return fs;
+			});
+			assert.strictEqual(writes, 0);
+			assert.strictEqual(flushes, 0);
+			assert.strictEqual(report.getIoStats().write.calls, 0);
+		});
+	});
+
+	describe('progress', () => {
+		testOnAllDisks(async (disk) => {
+			const mountProgress = [];
+			const options = {
+				yieldInterval: 1,
+				onProgress: (done, max) => mountProgress.push([done, max]),
+			};
+			await ext2fs.withMountedDisk(disk, 0, options, async ({ promises: fs }) => {
+				const [done, max] = mountProgress[mountProgress.length - 1];
+				assert(max > 0);
+				assert.strictEqual(done, max);
+				const trimProgress = [];
+				await fs.trim({ onProgress: (done, max) => trimProgress.push([done, max]) });
+				assert(trimProgress.length > 0);
+				for (const [done, max] of trimProgress) {
+					assert(done <= max);
+				}
+				await assert.rejects(fs.trim({ onProgress: () => {
+					throw new Error('stop');
+				} }), (err) => err.code === 'ECANCELED');
+			});
+		});
+	});
+
+	describe('batch', () => {
+		testOnAllDisksMount(async (fs) => {
+			await fs.symlink('/1', '/link');
+			const results = await fs.batch([
+				{ op: 'stat', path: '/link' },
+				{ op: 'lstat', path: '/link' },
+				{ op: 'readlink', path: '/link' },
+				{ op: 'stat', path: '/missing' },
+				{ op: 'readlink', path: '/2' },
+			]);
+			assert.strictEqual(results.length, 5);
+			const stats = await fs.stat('/1');
+			assert.deepStrictEqual(results[0].value, stats);
+			assert(results[1].value.isSymbolicLink());
+			assert.strictEqual(results[2].value, '/1');
+			assert.strictEqual(results[3].error.code, 'ENOENT');
+			assert.strictEqual(results[4].error.code, 'EINVAL');
+		});
+	});
+
+	describe('block cache', () => {
+		testOnAllDisks(async (disk) => {
+			const content = 'cached content\n';
+			for (const cacheSize of [0, 4096, 16 * 1024 ** 2]) {
+				const filename = `/cache_${cacheSize}`;
+				await ext2fs.withMountedDisk(disk, 0, { cacheSize }, async ({promises:fs}) => {
+					await fs.writeFile(filename, content);
+					assert.strictEqual(await fs.readFile(filename, 'utf8'), content);
+					if (cacheSize >= 1024 ** 2) {
+						// Directory blocks are read through the block cache on
+						// every readdir, the second one must not touch the disk.
+						const entries = await fs.readdir('/');
+						const { read, cacheHits } = fs.getIoStats();
+						assert.deepStrictEqual(await fs.readdir('/'), entries);
+						const stats = fs.getIoStats();
+						assert.strictEqual(stats.read.calls, read.calls);
+						assert(stats.cacheHits > cacheHits);
+					}
+				});
+				// Everything must have been written back on umount.
+				await ext2fs.withMountedDisk(disk, 0, { cacheSize: 0 }, async ({promises:fs}) => {
+					assert.strictEqual(await fs.readFile(filename, 'utf8'), content);
+				});
+			}
+			await assert.rejects(ext2fs.mount(disk, 0, { cacheSize: -1 }), TypeError);
+		});
+	});
+
+	describe('dentry cache', () => {
+		testOnAllDisks(async (disk) => {
+			for (const dentryCacheSize of [0, 1, 4096]) {
+				await ext2fs.withMountedDisk(disk, 0, { dentryCacheSize }, async ({promises:fs}) => {
+					const dir = `/dcache_${dentryCacheSize}`;
+					await fs.mkdir(dir);
+					await fs.mkdir(`${dir}/a`);
+					await fs.mkdir(`${dir}/a/b`);
+					await assert.rejects(fs.stat(`${dir}/a/b/c`), { code: 'ENOENT' });
+					await fs.writeFile(`${dir}/a/b/c`, 'c');
+					assert.strictEqual(await fs.readFile(`${dir}/a/b/c`, 'utf8'), 'c');
+					await fs.symlink(`${dir}/a`, `${dir}/link`);
+					assert.strictEqual(await fs.readFile(`${dir}/link/b/c`, 'utf8'), 'c');
+					await fs.rename(`${dir}/a/b`, `${dir}/b`);
+					await assert.rejects(fs.stat(`${dir}/a/b/c`), { code: 'ENOENT' });
+					assert.strictEqual(await fs.readFile(`${dir}/b/c`, 'utf8'), 'c');
+					await fs.link(`${dir}/b/c`, `${dir}/a/c`);
+					await fs.unlink(`${dir}/b/c`);
+					await assert.rejects(fs.stat(`${dir}/b/c`), { code: 'ENOENT' });
+					assert.strictEqual(await fs.readFile(`${dir}/a/c`, 'utf8'), 'c');
+					await fs.rmdir(`${dir}/b`);
+					await fs.mkdir(`${dir}/b`);
+					await assert.rejects(fs.stat(`${dir}/b/c`), { code: 'ENOENT' });
+					assert((await fs.stat(`${dir}/b`)).isDirectory());
+				});
+			}
+			await assert.rejects(ext2fs.mount(disk, 0, { dentryCacheSize: -1 }), TypeError);
+		});
+	});
+
+	describe('inode cache', () => {
+		testOnAllDisks(async (disk) => {
+			for (const inodeCacheSize of [0, 1, 256]) {
+				const filename = `/icache_${inodeCacheSize}`;
+				await ext2fs.withMountedDisk(disk, 0, { inodeCacheSize }, async ({promises:fs}) => {
+					await fs.writeFile(filename, 'a');
+					const first = await fs.open(filename, 'r+');
+					const second = await fs.open(filename, 'a');
+					await first.chmod(0o600);
+					await second.chown(1, 2);
+					await second.write('bc');
+					await first.write('d', 0);
+					const stats = await fs.stat(filename);
+					assert.strictEqual(stats.mode & 0o777, 0o600);
+					assert.strictEqual(stats.uid, 1);
+					assert.strictEqual(stats.gid, 2);
+					assert.strictEqual(stats.size, 3);
+					await first.close();
+					await second.close();
+				});
+				await ext2fs.withMountedDisk(disk, 0, { inodeCacheSize: 0 }, async ({promises:fs}) => {
+					const stats = await fs.stat(filename);
+					assert.strictEqual(stats.mode & 0o777, 0o600);
+					assert.strictEqual(stats.uid, 1);
+					assert.strictEqual(stats.gid, 2);
+					assert.strictEqual(await fs.readFile(filename, 'utf8'), 'dbc');
+				});
+			}
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				await fs.writeFile('/icache_close', 'a');
+				const fh = await fs.open('/icache_close', 'r+');
+				await fh.write('b', 0);
+				await fs.link('/icache_close', '/icache_close_link');
+				await fs.chmod('/icache_close', 0o640);
+				// Closing must not write back the inode as this handle last saw it.
+				await fh.close();
+				const stats = await fs.stat('/icache_close');
+				assert.strictEqual(stats.nlink, 2);
+				assert.strictEqual(stats.mode & 0o777, 0o640);
+			});
+			await ext2fs.withMountedDisk(disk, 0, { inodeCacheSize: 0 }, async ({promises:fs}) => {
+				const stats = await fs.stat('/icache_close');
+				assert.strictEqual(stats.nlink, 2);
+				assert.strictEqual(stats.mode & 0o777, 0o640);
+				assert.strictEqual(await fs.readFile('/icache_close_link', 'utf8'), 'b');
+			});
+			await assert.rejects(ext2fs.mount(disk, 0, { inodeCacheSize: -1 }), TypeError);
+		});
+	});
+
+	describe('readahead', () => {
+		testOnAllDisks(async (disk) => {
+			const size = 1024 ** 2;
+			const buf = Buffer.alloc(size);
+			for (let i = 0; i < size; i += 4) {
+				buf.writeUInt32LE(i, i);
+			}
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				await fs.writeFile('/sequential', buf);
+			});
+			const reads = {};
+			for (const readahead of [0, 4096, 1024 ** 2]) {
+				await ext2fs.withMountedDisk(disk, 0, { readahead }, async (fs) => {
+					const data = Buffer.alloc(size);
+					const fh = await fs.promises.open('/sequential', 'r');
+					fs.resetIoStats();
+					const { bytesRead } = await fh.read(data, 0, size, 0);
+					reads[readahead] = fs.getIoStats().read.calls;
+					await fh.close();
+					assert.strictEqual(bytesRead, size);
+					assert(data.equals(buf));
+				});
+			}
+			// The same sequential read takes far fewer disk reads.
+			assert(reads[1024 ** 2] * 4 < reads[0]);
+			assert(reads[1024 ** 2] <= reads[4096]);
+		});
+	});
+
+	describe('gathered write back', () => {
+		testOnAllDisks(async (disk) => {
+			const writes = [];
+			disk.writev = async (chunks) => {
+				writes.push(chunks.map(({ buffer, offset }) => [offset, buffer.length]));
+				for (const { buffer, offset } of chunks) {
+					await disk.write(buffer, 0, buffer.length, offset);
+				}
+			};
+			const mounted = await ext2fs.mount(disk, 0, { dirtySize: 64 * 1024 });
+			let blockSize;
+			try {
+				const fs = mounted.promises;
+				blockSize = (await fs.stat('/')).blksize;
+				for (let i = 0; i < 20; i++) {
+					await fs.writeFile(`/gathered_${i}`, `content ${i}\n`);
+				}
+			} finally {
+				const report = await ext2fs.umount(mounted);
+				// Several dirty blocks go out with each write request.
+				assert(report.write.calls < report.write.blocks);
+				assert(report.write.ranges > report.write.calls);
+			}
+			// Some write back handed several chunks to a single writev, in
+			// order and not overlapping, and merged contiguous blocks.
+			assert(writes.some((chunks) => chunks.length > 1));
+			for (const chunks of writes) {
+				for (let i = 1; i < chunks.length; i++) {
+					const [offset, length] = chunks[i - 1];
+					assert(offset + length <= chunks[i][0]);
+				}
+			}
+			assert(writes.some((chunks) => chunks.some(([, length]) => length > blockSize)));
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				for (let i = 0; i < 20; i++) {
+					assert.strictEqual(await fs.readFile(`/gathered_${i}`, 'utf8'), `content ${i}\n`);
+				}
+			});
+		});
+	});
+
+	describe('trim range and minimum length', () => {
+		testOnAllDisks(async (disk) => {
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				assert.strictEqual(await fs.trim({ minLength: 1024 ** 3 }), 0);
+				assert.strictEqual(await fs.trim({ start: 1024 ** 4 }), 0);
+				assert.strictEqual(await fs.trim({ length: 0 }), 0);
+				const all = await fs.trim();
+				assert(all > 0);
+				assert.strictEqual(await fs.trim(), all);
+				const head = await fs.trim({ length: 2 * 1024 ** 2 });
+				const tail = await fs.trim({ start: 2 * 1024 ** 2 });
+				assert.strictEqual(head + tail, all);
+				await assert.rejects(fs.trim({ start: -1 }), TypeError);
+			});
+		});
+	});
+
+	describe('batched discard', () => {
+		testOnAllDisks(async (disk) => {
+			const calls = [];
+			disk.discardMany = async (ranges) => {
+				calls.push(ranges);
+				for (const { offset, length } of ranges) {
+					await disk.discard(offset, length);
+				}
+			};
+			const granularity = 1024 ** 2;
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				const all = await fs.trim();
+				assert.strictEqual(calls.length, 1);
+				const ranges = calls[0];
+				assert.strictEqual(ranges.reduce((sum, { length }) => sum + length, 0), all);
+				for (let i = 1; i < ranges.length; i++) {
+					assert(ranges[i].offset > ranges[i - 1].offset + ranges[i - 1].length);
+				}
+			});
+			calls.length = 0;
+			await ext2fs.withMountedDisk(disk, 0, { discardGranularity: granularity }, async ({promises:fs}) => {
+				const aligned = await fs.trim();
+				assert(calls.length <= 1);
+				for (const { offset, length } of calls.flat()) {
+					assert.strictEqual(offset % granularity, 0);
+					assert.strictEqual(length % granularity, 0);
+				}
+				assert.strictEqual(await fs.trim(), aligned);
+			});
+		});
+	});
+
+	describe('synchronous disk', () => {
+		for (const name of Object.keys(IMAGES)) {
+			it(name, async () => {
+				const path = pathModule.join(__dirname, 'fixtures', IMAGES[name]);
+				const image = await readFile(path);
+				const unexpected = async () => {
+					throw new Error('async disk method called');
+				};
+				const disk = {
+					read: unexpected,
+					write: unexpected,
+					flush: unexpected,
+					readSync: (buffer, bufferOffset, length, fileOffset) => {
+						return image.copy(buffer, bufferOffset, fileOffset, fileOffset + length);
+					},
+					writeSync: (buffer, bufferOffset, length, fileOffset) => {
+						return buffer.copy(image, fileOffset, bufferOffset, bufferOffset + length);
+					},
+					flushSync: () => {},
+					discard: async () => {},
+				};
+				await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+					assert.strictEqual(await fs.readFile('/1', 'utf8'), 'one\n');
+					await fs.writeFile('/sync', 'synchronous\n');
+				});
+				await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+					assert.strictEqual(await fs.readFile('/sync', 'utf8'), 'synchronous\n');
+				});
+			});
+		}
+	});
+
+	describe('staging arena', () => {
+		testOnAllDisksMount(async (fs) => {
+			const { Module } = fs.instance;
+			const malloc = Module._malloc_from_js;
+			let mallocs = 0;
+			// Fills the arena with the blocks the loop below needs.
+			await fs.writeFile('/arena', 'content 0\n');
+			await fs.readFile('/arena', 'utf8');
+			Module._malloc_from_js = (...args) => {
+				mallocs += 1;
+				return malloc(...args);
+			};
+			try {
+				for (let i = 0; i < 10; i++) {
+					await fs.writeFile('/arena', `content ${i}\n`);
+					assert.strictEqual(await fs.readFile('/arena', 'utf8'), `content ${i}\n`);
+				}
+			} finally {
+				Module._malloc_from_js = malloc;
+			}
+			assert.strictEqual(mallocs, 0);
+			// Large blocks go back to the heap right away.
+			await fs.writeFile('/arena', Buffer.alloc(512 * 1024));
+			await fs.readFile('/arena');
+			assert(fs.arena.idle <= 256 * 1024);
+		});
+
+		testOnAllDisks(async (disk) => {
+			const fs = await ext2fs.mount(disk, 0);
+			let settled = false;
+			const pending = fs.promises.stat('/1').then(() => {
+				settled = true;
+			}, () => {
+				settled = true;
+			});
+			// umount must not free the blocks of a call that is still running.
+			await ext2fs.umount(fs);
+			assert(settled);
+			await pending;
+		});
+	});
+
+	describe('fstat', () => {
+		testOnAllDisksMount(async (fs) => {
+			const handle = await fs.open('/1', 'r');
+			try {
+				fs.resetQueueMetrics();
+				const stats = await handle.stat();
+				// The whole structure comes from a single call.
+				assert(fs.getQueueMetrics().enqueued <= 1);
+				assert.strictEqual(stats.size, 4);
+				assert(stats.isFile());
+				assert.deepStrictEqual(stats, await fs.stat('/1'));
+			} finally {
+				await handle.close();
+			}
+		});
+	});
+
+	describe('stat sub-millisecond times', () => {
+		testOnAllDisksMount(async (fs) => {
+			await fs.writeFile('/times', 'times');
+			const stats = await fs.stat('/times');
+			assert.strictEqual(typeof stats.mtimeNs, 'bigint');
+			assert.strictEqual(stats.mtime.getTime(), Math.floor(stats.mtimeMs));
+			assert.strictEqual(stats.birthtimeNs, stats.ctimeNs);
+			for (const name of ['atime', 'mtime', 'ctime']) {
+				const ns = stats[`${name}Ns`];
+				const ms = stats[`${name}Ms`];
+				assert(Math.abs(Number(ns) / 1e6 - ms) < 1e-3);
+				// 128 byte inodes have no room for the nanoseconds.
+				if (ns % BigInt(1e9) !== BigInt(0)) {
+					assert.notStrictEqual(ns % BigInt(1e6), BigInt(0));
+					assert.notStrictEqual(ms % 1, 0);
+				}
+			}
+		});
+	});
+
+	describe('readdir with file types', () => {
+		testOnAllDisksMount(async (fs) => {
+			await fs.mkdir('/types');
+			await fs.writeFile('/types/file', 'file');
+			await fs.mkdir('/types/dir');
+			await fs.symlink('/types/file', '/types/link');
+			const entries = await fs.readdir('/types', { withFileTypes: true });
+			const byName = new Map(entries.map((entry) => [entry.name, entry]));
+			assert.deepStrictEqual([...byName.keys()].sort(), ['dir', 'file', 'link']);
+			assert(byName.get('file').isFile());
+			assert(byName.get('dir').isDirectory());
+			assert(byName.get('link').isSymbolicLink());
+			assert(!byName.get('link').isFile());
+			assert.strictEqual(byName.get('file').parentPath, '/types');
+			const names = await fs.readdir('/types', { encoding: 'buffer' });
+			assert(names.every((name) => Buffer.isBuffer(name)));
+			assert.deepStrictEqual(names.map(String).sort(), ['dir', 'file', 'link']);
+			assert.deepStrictEqual(await fs.readdir('/types/dir'), []);
+		});
+	});
+
+	describe('stat without opening', () => {
+		testOnAllDisksMount(async (fs) => {
+			await fs.symlink('/1', '/stat_link');
+			fs.resetQueueMetrics();
+			const stats = await fs.stat('/stat_link');
+			assert(fs.getQueueMetrics().enqueued <= 1);
+			assert(stats.isFile());
+			assert.strictEqual(stats.size, 4);
+			assert((await fs.lstat('/stat_link')).isSymbolicLink());
+			await fs.access('/stat_link');
+			await assert.rejects(fs.stat('/missing'), { code: 'ENOENT' });
+			await assert.rejects(fs.lstat('/missing/1'), { code: 'ENOENT' });
+			await assert.rejects(fs.access('/missing'), { code: 'ENOENT' });
+		});
+	});
+
+	describe('io stats', () => {
+		testOnAllDisks(async (disk) => {
+			const fs = await ext2fs.mount(disk, 0, { cacheSize: 0 });
+			let stats = fs.getIoStats();
+			assert(stats.read.calls > 0);
+			assert(stats.read.bytes >= stats.read.calls * 512);
+			assert.strictEqual(stats.read.latency.length, 16);
+			assert.strictEqual(stats.read.latency.reduce((a, b) => a + b), stats.read.calls);
+			fs.resetIoStats();
+			stats = fs.getIoStats();
+			assert.strictEqual(stats.read.calls, 0);
+			assert.strictEqual(stats.write.calls, 0);
+			await fs.promises.writeFile('/stats', 'io stats\n');
+			const report = await ext2fs.umount(fs);
+			assert.deepStrictEqual(fs.getIoStats(), report);
+			assert(report.write.calls > 0);
+			assert(report.write.blocks > 0);
+			assert(report.write.metadataBlocks > 0);
+			assert(report.write.dataBlocks > 0);
+			assert.strictEqual(report.write.sequential + report.write.random, report.write.ranges);
+			assert.strictEqual(report.write.sizes.reduce((a, b) => a + b), report.write.ranges);
+			assert(report.flush.calls > 0);
+			// New file blocks are written directly, they are never zeroed first.
+			assert.strictEqual(report.zeroOut.calls, 0);
+			assert.strictEqual(report.zeroOutWrites, 0);
+		});
+	});
+
+	describe('disk zeroOut', () => {
+		it('hands whole ranges to the backend', async () => {
+			const ranges = [];
+			const backend = {
+				async zeroOut(offset, length) {
+					ranges.push([offset, length]);
+				},
+			};
+			const disk = new DiskWrapper(backend, 1024);
+			// DISK_CAP_ZEROOUT in src/glue.c
+			assert.strictEqual(disk.capabilities() & 0x0001, 0x0001);
+			// Not a multiple of the 256KiB zero buffer chunks.
+			const length = 3 * 256 * 1024 + 512;
+			await disk.zeroOut(4096, length);
+			assert.deepStrictEqual(ranges, [[4096 + 1024, length]]);
+		});
+
+		it('is not a capability without a backend method', async () => {
+			const disk = new DiskWrapper({}, 1024);
+			assert.strictEqual(disk.capabilities() & 0x0001, 0);
+			await assert.rejects(disk.zeroOut(0, 512), TypeError);
+		});
+	});
+
+	describe('operation queue', () => {
+		testOnAllDisks(async (disk) => {
+			await ext2fs.withMountedDisk(disk, 0, { isolated: true, maxQueueDepth: 16 }, async (fs) => {
+				const { promises } = fs;
+				promises.resetQueueMetrics();
+				const results = await Promise.allSettled(new Array(32).fill().map(() => promises.stat('/1')));
+				assert(results.some(({ status, reason }) => status === 'rejected' && reason.code === 'EAGAIN'));
+				const controller = new AbortController();
+				const pending = ext2fs.withSignal(controller.signal, () => {
+					return Promise.all([promises.readFile('/1', 'utf8'), promises.readFile('/2', 'utf8')]);
+				});
+				controller.abort();
+				await assert.rejects(pending, (err) => err.name === 'AbortError');
+				assert.strictEqual(await promises.readFile('/3', 'utf8'), 'three\n');
+				const metrics = promises.getQueueMetrics();
+				assert.strictEqual(metrics.maxDepth, 16);
+				assert.strictEqual(metrics.depth, 0);
+				assert(metrics.rejected > 0);
+				assert(metrics.aborted > 0);
+				assert(metrics.completed > 0);
+				assert(metrics.serviceTime.total > 0);
+				assert.strictEqual(metrics.running, false);
+			});
+			// The shared queue is not limited by a single mount.
+			await assert.rejects(ext2fs.mount(disk, 0, { maxQueueDepth: 16 }), TypeError);
+			await ext2fs.withMountedDisk(disk, 0, async ({ promises: fs }) => {
+				assert.strictEqual(fs.getQueueMetrics().maxDepth, Infinity);
+			});
+		});
+	});
+
+	describe('isolated mounts', () => {
+		testOnAllDisks(async (disk) => {
+			const path = pathModule.join(__dirname, 'fixtures', IMAGES[disk.imageName]);
+			await filedisk.withOpenFile(path, 'r', async (fd) => {
+				const other = new filedisk.FileDisk(fd, true, true);
+				let unblock;
+				const blocked = new Promise((resolve) => {
+					unblock = resolve;
+				});
+				const read = disk.read.bind(disk);
+				let block = false;
+				disk.read = async (...args) => {
+					if (block) {
+						await blocked;
+					}
+					return await read(...args);
+				};
+				const slow = await ext2fs.mount(disk, 0, { cacheSize: 0, isolated: true });
+				const fast = await ext2fs.mount(other, 0, { isolated: true });
+				try {
+					assert.notStrictEqual(slow.instance.Module, fast.instance.Module);
+					block = true;
+					const pending = slow.promises.readFile('/1', 'utf8');
+					assert.strictEqual(await fast.promises.readFile('/2', 'utf8'), 'two\n');
+					unblock();
+					assert.strictEqual(await pending, 'one\n');
+				} finally {
+					unblock();
+					await ext2fs.umount(fast);
+					await ext2fs.umount(slow);
+				}
+			});
+		});
+
+		testOnAllDisks(async (disk) => {
+			const instantiate = WebAssembly.instantiate;
+			WebAssembly.instantiate = async () => {
+				throw new Error('instantiation failed');
+			};
+			try {
+				await assert.rejects(ext2fs.mount(disk, 0, { isolated: true }), /instantiation failed/);
+			} finally {
+				WebAssembly.instantiate = instantiate;
+			}
+			await ext2fs.withMountedDisk(disk, 0, { isolated: true }, async ({ promises: fs }) => {
+				assert.strictEqual(await fs.readFile('/1', 'utf8'), 'one\n');
+			});
+		});
+	});
+
+	describe('mount pool', () => {
+		// Opens every image, then calls `fn` with their disks.
+		function withOpenImages(names, fn, disks = []) {
+			if (disks.length === names.length) {
+				return fn(disks);
+			}
+			const path = pathModule.join(__dirname, 'fixtures', IMAGES[names[disks.length]]);
+			return filedisk.withOpenFile(path, 'r', (fd) => {
+				return withOpenImages(names, fn, disks.concat(new filedisk.FileDisk(fd, true, true)));
+			});
+		}
+
+		for (const worker of [false, true]) {
+			it(`runs jobs on every image${worker ? ' in workers' : ''}`, async () => {
+				const names = Object.keys(IMAGES);
+				await withOpenImages(names, async (disks) => {
+					const pool = ext2fs.createPool({ concurrency: 2, worker });
+					try {
+						const jobs = disks.map((disk, i) => ({ name: names[i], disk }));
+						const results = pool.map(jobs, async ({ promises: fs }, job) => {
+							return `${job.name}: ${await fs.readFile('/1', 'utf8')}`;
+						});
+						const seen = [];
+						let result;
+						while (!(result = await results.next()).done) {
+							assert.strictEqual(result.value.error, undefined);
+							assert.strictEqual(result.value.value, `${result.value.job.name}: one\n`);
+							seen.push(result.value.index);
+						}
+						assert.deepStrictEqual(seen.sort(), names.map((_name, i) => i));
+						const stats = pool.getStats();
+						assert.strictEqual(stats.length, 2);
+						assert.strictEqual(stats.reduce((total, lane) => total + lane.completed, 0), names.length);
+						assert.strictEqual(await pool.run(disks[0], 0, async ({ promises: fs }) => {
+							return await fs.readFile('/2', 'utf8');
+						}), 'two\n');
+					} finally {
+						await pool.close();
+					}
+					await assert.rejects(pool.run(disks[0], 0, () => {}), /closed/);
+				});
+			});
+		}
+
+		it('steals jobs and counts failures', async () => {
+			const name = Object.keys(IMAGES)[0];
+			await withOpenImages([name], async ([disk]) => {
+				const pool = ext2fs.createPool({ concurrency: 2 });
+				try {
+					let unblock;
+					const blocked = new Promise((resolve) => {
+						unblock = resolve;
+					});
+					const options = { readOnly: true };
+					// Keeps the first lane busy while the jobs queued behind it
+					// are taken by the other one.
+					const first = pool.run(disk, 0, options, () => blocked);
+					const others = new Array(6).fill().map(() => {
+						return pool.run(disk, 0, options, ({ promises: fs }) => fs.readFile('/1', 'utf8'));
+					});
+					assert.deepStrictEqual(await Promise.all(others), new Array(6).fill('one\n'));
+					unblock();
+					await first;
+					await assert.rejects(pool.run(disk, 0, options, async () => {
+						throw new Error('job failed');
+					}), /job failed/);
+					const stats = pool.getStats();
+					assert(stats[1].stolen > 0);
+					assert.strictEqual(stats.reduce((total, lane) => total + lane.completed, 0), 7);
+					assert.strictEqual(stats.reduce((total, lane) => total + lane.failed, 0), 1);
+				} finally {
+					await pool.close();
+				}
+			});
+		});
+	});
+
+	describe('worker mount', () => {
+		testOnAllDisks(async (disk) => {
+			const fs = await ext2fs.mount(disk, 0, { worker: true });
+			let stats;
+			try {
+				const { promises } = fs;
+				// The worker is only reachable through ext2fs.umount.
+				assert.strictEqual(fs.worker, undefined);
+				assert.strictEqual(promises.worker, undefined);
+				assert.strictEqual(fs.umountWorker, undefined);
+				assert.strictEqual(await promises.readFile('/1', 'utf8'), 'one\n');
+				await promises.writeFile('/worker', Buffer.from('from a worker\n'));
+				const workerStats = await promises.stat('/worker');
+				assert(workerStats.isFile());
+				assert.strictEqual(typeof workerStats.mtimeNs, 'bigint');
+				assert((await promises.readdir('/')).includes('worker'));
+				const handle = await promises.open('/worker', 'r');
+				const buffer = Buffer.alloc(6);
+				const { bytesRead } = await handle.read(buffer, 0, 6, 7);
+				await handle.close();
+				assert.strictEqual(bytesRead, 6);
+				assert.strictEqual(buffer.toString(), 'worker');
+				await assert.rejects(promises.stat('/missing'), (err) => err.code === 'ENOENT');
+				await assert.rejects(promises.trim({ onProgress: () => {} }), TypeError);
+				assert(await promises.trim() >= 0);
+				// After the read above, which updated the access time.
+				stats = await promises.stat('/worker');
+			} finally {
+				const report = await ext2fs.umount(fs);
+				assert(report.write.calls > 0);
+			}
+			await ext2fs.withMountedDisk(disk, 0, async ({promises:fs}) => {
+				// Stats cross the thread boundary as the raw fields.
+				assert.deepStrictEqual(await fs.stat('/worker'), stats);
+				assert.strictEqual(await fs.readFile('/worker', 'utf8'), 'from a worker\n');
+			});
+			await assert.rejects(ext2fs.mount(disk, 0, { worker: true, onProgress: () => {} }), TypeError);
+		});
+	});
+
 	describe('readlink', () => {
 		const target = '/usr/bin/echo';
 		const linkpath = '/testlink';